@@ -27,6 +27,9 @@ void sha256_finalize(struct sha256_compute_data* data,
 		uint8_t hash[SHA256_INT_SZ]);
 
 
+void sha256_output(struct sha256_compute_data* data,
+		uint8_t* hash);
+
 void sha256_output_hex(struct sha256_compute_data* data, 
 		char hexbuf[SHA256_CHUNK_SZ]);
 
@@ -9,6 +9,12 @@
 #include "network.h"
 #include "peer.h"
 #include "package.h"
+#include "download.h"
+#include "superseed.h"
+#include "ratelimit.h"
+#include "connector.h"
+#include "diskio.h"
+#include "chunkcache.h"
 
 void print_usage() {
     printf("Usage: btide <config_file>\n");
@@ -45,7 +51,11 @@ void process_command(char *command) {
             printf("Unable to parse bpkg file.\n");
             return;
         }
-        add_package_to_list(pkg);
+        if (add_package_to_list(pkg) < 0) {
+            printf("Package is already managed.\n");
+            free_package(pkg);
+            return;
+        }
         printf("Package loaded successfully.\n");
 
     } else if (strcmp(cmd, "REMPACKAGE") == 0) {
@@ -55,8 +65,14 @@ void process_command(char *command) {
             return;
         }
         Package *pkg = find_package_by_identifier(ident);
-        if (pkg) {
-            free_package(pkg);
+        if (pkg && remove_package_from_list(pkg) == 0) {
+            // Unpublished everywhere before the registry lets go of it;
+            // threads holding their own reference finish first
+            download_package_removed(pkg);
+            superseed_package_removed(pkg);
+            peer_forget_package(pkg);
+            disk_forget_package(pkg);
+            release_package(pkg);
             printf("Package removed successfully.\n");
         } else {
             printf("Identifier provided does not match managed packages.\n");
@@ -69,7 +85,7 @@ void process_command(char *command) {
         } else {
             for (int i = 0; i < package_count; ++i) {
                 printf("%d. %s, %s : %s\n", i + 1, packages[i]->ident, packages[i]->filename,
-                    (packages[i]->nchunks == 0) ? "INCOMPLETE" : "COMPLETED");
+                    package_is_complete(packages[i]) ? "COMPLETED" : "INCOMPLETE");
             }
         }
     } else if (strcmp(cmd, "PEERS") == 0) {
@@ -85,9 +101,76 @@ void process_command(char *command) {
             return;
         }
         uint16_t port = (uint16_t)atoi(port_str);
-        int offset = offset_str ? atoi(offset_str) : 0;
+        uint32_t offset = offset_str ? (uint32_t)strtoul(offset_str, NULL, 10) : FETCH_WHOLE_CHUNK;
 
         fetch_chunk(address, port, identifier, hash, offset);
+    } else if (strcmp(cmd, "FETCHALL") == 0) {
+        char *address = strtok(NULL, ":");
+        char *port_str = strtok(NULL, " ");
+        char *identifier = strtok(NULL, " ");
+        char *first_str = strtok(NULL, " ");
+        char *count_str = strtok(NULL, "");
+        if (!address || !port_str || !identifier) {
+            printf("Missing arguments from command.\n");
+            return;
+        }
+        uint16_t port = (uint16_t)atoi(port_str);
+        Package *pkg = find_package_by_identifier(identifier);
+        if (!pkg) {
+            printf("Unable to request chunks, package is not managed\n");
+            return;
+        }
+        uint32_t first = first_str ? (uint32_t)atoi(first_str) : 0;
+        uint32_t count = count_str ? (uint32_t)atoi(count_str) : pkg->nchunks - first;
+
+        fetch_chunk_range(address, port, identifier, first, count);
+    } else if (strcmp(cmd, "FETCHTREE") == 0) {
+        char *address = strtok(NULL, ":");
+        char *port_str = strtok(NULL, " ");
+        char *identifier = strtok(NULL, " ");
+        char *hash = strtok(NULL, "");
+        if (!address || !port_str || !identifier || !hash) {
+            printf("Missing arguments from command.\n");
+            return;
+        }
+        uint16_t port = (uint16_t)atoi(port_str);
+
+        fetch_subtree(address, port, identifier, hash);
+    } else if (strcmp(cmd, "DOWNLOAD") == 0) {
+        char *identifier = strtok(NULL, "");
+        if (!identifier) {
+            printf("Missing identifier argument.\n");
+            return;
+        }
+        Package *pkg = find_package_by_identifier(identifier);
+        if (!pkg) {
+            printf("Unable to download, package is not managed\n");
+            return;
+        }
+        if (start_download(pkg) == 0) {
+            printf("Downloading %s from connected peers.\n", pkg->ident);
+        }
+    } else if (strcmp(cmd, "SUPERSEED") == 0) {
+        char *identifier = strtok(NULL, "");
+        if (!identifier) {
+            printf("Missing identifier argument.\n");
+            return;
+        }
+        Package *pkg = find_package_by_identifier(identifier);
+        if (!pkg) {
+            printf("Unable to super-seed, package is not managed\n");
+            return;
+        }
+        if (start_superseed(pkg) == 0) {
+            printf("Super-seeding %s to connected peers.\n", pkg->ident);
+        }
+    } else if (strcmp(cmd, "CACHE") == 0) {
+        uint64_t hits, misses, coalesced, bytes;
+        uint32_t entries;
+        cache_stats(&hits, &misses, &coalesced, &bytes, &entries);
+        printf("Chunk cache: %u chunks, %llu KB, %llu hits, %llu misses, %llu reads shared\n", entries,
+            (unsigned long long)(bytes / 1024), (unsigned long long)hits, (unsigned long long)misses,
+            (unsigned long long)coalesced);
     } else if (strcmp(cmd, "QUIT") == 0) {
         exit(0);
     } else {
@@ -102,10 +185,17 @@ int main(int argc, char *argv[]) {
     }
 
     load_config(argv[1]);
+    init_rate_limits();
+    start_disk_io();
+    init_chunk_cache();
 
     pthread_t server_thread;
     pthread_create(&server_thread, NULL, (void *(*)(void *))start_server, (void *)(intptr_t)config.port);
     pthread_detach(server_thread);
+    start_heartbeats();
+    start_choker();
+    start_pex();
+    start_bootstrap();
 
     char command[5520];
     while (1) {
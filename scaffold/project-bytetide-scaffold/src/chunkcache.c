@@ -0,0 +1,309 @@
+// src/chunkcache.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "config.h"
+#include "network.h"
+#include "chunkcache.h"
+
+static CacheShard shards[CACHE_SHARDS];
+static uint64_t shard_capacity = 0;
+static uint64_t cache_hits = 0;
+static uint64_t cache_misses = 0;
+// Lookups served by waiting on another's read
+static uint64_t cache_coalesced = 0;
+
+void init_chunk_cache(void) {
+    shard_capacity = (uint64_t)config.cache_size * 1024 / CACHE_SHARDS;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        pthread_cond_init(&shards[i].landed, NULL);
+    }
+}
+
+// The digest is already a uniform hash, so its words serve as keys
+static uint64_t digest_word(const uint8_t digest[DIGEST_LEN], int word) {
+    uint64_t v;
+    memcpy(&v, digest + word * 8, sizeof(v));
+    return v;
+}
+
+static int chunk_key(const Package *pkg, uint32_t index, uint8_t digest[DIGEST_LEN]) {
+    return hex_to_digest(pkg->chunks[index].hash, digest);
+}
+
+static CacheShard* shard_of(const uint8_t digest[DIGEST_LEN]) {
+    return &shards[digest_word(digest, 0) % CACHE_SHARDS];
+}
+
+static uint32_t sketch_slot(const uint8_t digest[DIGEST_LEN], int row) {
+    uint64_t h = digest_word(digest, 1 + row / 2);
+    return (uint32_t)(row % 2 ? h >> 32 : h) % CACHE_SKETCH_WIDTH;
+}
+
+// Caller holds the shard lock
+static void sketch_record(CacheShard *shard, const uint8_t digest[DIGEST_LEN]) {
+    for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+        uint8_t *counter = &shard->sketch[row][sketch_slot(digest, row)];
+        if (*counter < CACHE_SKETCH_MAX) {
+            (*counter)++;
+        }
+    }
+    if (++shard->samples >= CACHE_SKETCH_RESET) {
+        for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+            for (int i = 0; i < CACHE_SKETCH_WIDTH; i++) {
+                shard->sketch[row][i] >>= 1;
+            }
+        }
+        shard->samples /= 2;
+    }
+}
+
+// Estimated lookups of the digest, the least of its counters
+static uint8_t sketch_estimate(const CacheShard *shard, const uint8_t digest[DIGEST_LEN]) {
+    uint8_t estimate = CACHE_SKETCH_MAX;
+    for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+        uint8_t counter = shard->sketch[row][sketch_slot(digest, row)];
+        if (counter < estimate) {
+            estimate = counter;
+        }
+    }
+    return estimate;
+}
+
+static CacheEntry** bucket_of(CacheShard *shard, const uint8_t digest[DIGEST_LEN]) {
+    return &shard->buckets[digest_word(digest, 3) % CACHE_BUCKETS];
+}
+
+static CacheEntry* lookup(CacheShard *shard, const uint8_t digest[DIGEST_LEN]) {
+    CacheEntry *entry = *bucket_of(shard, digest);
+    while (entry && memcmp(entry->digest, digest, DIGEST_LEN) != 0) {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+static void lru_unlink(CacheShard *shard, CacheEntry *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        shard->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        shard->tail = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+}
+
+static void lru_push(CacheShard *shard, CacheEntry *entry) {
+    entry->next = shard->head;
+    if (shard->head) {
+        shard->head->prev = entry;
+    } else {
+        shard->tail = entry;
+    }
+    shard->head = entry;
+}
+
+// Takes the entry out of the shard; it is freed once nobody holds it
+static void evict(CacheShard *shard, CacheEntry *entry) {
+    CacheEntry **link = bucket_of(shard, entry->digest);
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+    lru_unlink(shard, entry);
+    shard->bytes -= entry->size;
+    shard->entries--;
+    entry->evicted = 1;
+    if (entry->refs == 0) {
+        free(entry);
+    }
+}
+
+static CacheFlight** find_flight(CacheShard *shard, const uint8_t digest[DIGEST_LEN]) {
+    CacheFlight **link = &shard->flights;
+    while (*link && memcmp((*link)->digest, digest, DIGEST_LEN) != 0) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// Caller holds the shard lock
+static void put_entry(CacheEntry *entry) {
+    if (--entry->refs == 0 && entry->evicted) {
+        free(entry);
+    }
+}
+
+// Looks the chunk up, counting the lookup toward its popularity.
+// CACHE_HIT sets entry with a reference held, to drop with
+// cache_release. A read already in flight is waited for unless wait is
+// 0, which returns CACHE_BUSY instead so a caller holding claims never
+// waits on another. On CACHE_CLAIMED the caller reads the chunk and
+// hands it to cache_fill.
+int cache_acquire(const Package *pkg, uint32_t index, int wait, CacheEntry **entry) {
+    uint8_t digest[DIGEST_LEN];
+    *entry = NULL;
+    if (chunk_key(pkg, index, digest) < 0) {
+        return CACHE_MISS;
+    }
+    CacheShard *shard = shard_of(digest);
+    pthread_mutex_lock(&shard->lock);
+    sketch_record(shard, digest);
+    while (1) {
+        CacheEntry *hit = lookup(shard, digest);
+        if (hit) {
+            hit->refs++;
+            lru_unlink(shard, hit);
+            lru_push(shard, hit);
+            pthread_mutex_unlock(&shard->lock);
+            __atomic_add_fetch(&cache_hits, 1, __ATOMIC_RELAXED);
+            *entry = hit;
+            return CACHE_HIT;
+        }
+
+        CacheFlight *flight = *find_flight(shard, digest);
+        if (!flight) {
+            break;
+        }
+        if (!wait) {
+            pthread_mutex_unlock(&shard->lock);
+            return CACHE_BUSY;
+        }
+        flight->waiters++;
+        while (!flight->done) {
+            pthread_cond_wait(&shard->landed, &shard->lock);
+        }
+        hit = flight->entry;
+        if (hit) {
+            hit->refs++;
+        }
+        // The last waiter out drops the flight and its reference
+        if (--flight->waiters == 0) {
+            if (flight->entry) {
+                put_entry(flight->entry);
+            }
+            free(flight);
+        }
+        if (hit) {
+            pthread_mutex_unlock(&shard->lock);
+            __atomic_add_fetch(&cache_coalesced, 1, __ATOMIC_RELAXED);
+            *entry = hit;
+            return CACHE_HIT;
+        }
+        // The read failed; look again, possibly claiming it ourselves
+    }
+
+    // Too big to hold in memory whole, the caller streams it
+    if (pkg->chunks[index].size > BATCH_MAX_BYTES) {
+        pthread_mutex_unlock(&shard->lock);
+        __atomic_add_fetch(&cache_misses, 1, __ATOMIC_RELAXED);
+        return CACHE_MISS;
+    }
+    CacheFlight *flight = calloc(1, sizeof(CacheFlight));
+    if (!flight) {
+        pthread_mutex_unlock(&shard->lock);
+        __atomic_add_fetch(&cache_misses, 1, __ATOMIC_RELAXED);
+        return CACHE_MISS;
+    }
+    memcpy(flight->digest, digest, DIGEST_LEN);
+    flight->next = shard->flights;
+    shard->flights = flight;
+    pthread_mutex_unlock(&shard->lock);
+    __atomic_add_fetch(&cache_misses, 1, __ATOMIC_RELAXED);
+    return CACHE_CLAIMED;
+}
+
+// Caller holds the shard lock. Admits the entry if there is room, or
+// if it is more popular than each entry it would evict; otherwise it
+// is only kept while someone holds it.
+static void admit(CacheShard *shard, CacheEntry *entry) {
+    // One chunk may take at most a quarter of its shard
+    if (entry->size > shard_capacity / 4) {
+        entry->evicted = 1;
+        return;
+    }
+    uint8_t popularity = sketch_estimate(shard, entry->digest);
+    while (shard->bytes + entry->size > shard_capacity) {
+        if (popularity <= sketch_estimate(shard, shard->tail->digest)) {
+            entry->evicted = 1;
+            return;
+        }
+        evict(shard, shard->tail);
+    }
+    CacheEntry **bucket = bucket_of(shard, entry->digest);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    lru_push(shard, entry);
+    shard->bytes += entry->size;
+    shard->entries++;
+}
+
+// Settles a claim from cache_acquire with the verified bytes read from
+// disk, or NULL if the read failed, and wakes whoever waited on it
+void cache_fill(const Package *pkg, uint32_t index, const char *data) {
+    uint8_t digest[DIGEST_LEN];
+    uint32_t size = pkg->chunks[index].size;
+    if (chunk_key(pkg, index, digest) < 0) {
+        return;
+    }
+    CacheShard *shard = shard_of(digest);
+    CacheEntry *entry = data ? malloc(sizeof(CacheEntry) + size) : NULL;
+    if (entry) {
+        memcpy(entry->digest, digest, DIGEST_LEN);
+        entry->size = size;
+        entry->shard = (int)(shard - shards);
+        entry->refs = 0;
+        entry->evicted = 0;
+        entry->hash_next = entry->prev = entry->next = NULL;
+        memcpy(entry->data, data, size);
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    CacheFlight **link = find_flight(shard, digest);
+    CacheFlight *flight = *link;
+    *link = flight->next;
+    if (entry) {
+        admit(shard, entry);
+    }
+    if (flight->waiters > 0) {
+        if (entry) {
+            entry->refs++;
+        }
+        flight->entry = entry;
+        flight->done = 1;
+        pthread_cond_broadcast(&shard->landed);
+    } else {
+        if (entry && entry->evicted) {
+            free(entry);
+        }
+        free(flight);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void cache_release(CacheEntry *entry) {
+    CacheShard *shard = &shards[entry->shard];
+    pthread_mutex_lock(&shard->lock);
+    put_entry(entry);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void cache_stats(uint64_t *hits, uint64_t *misses, uint64_t *coalesced, uint64_t *bytes, uint32_t *entries) {
+    *hits = __atomic_load_n(&cache_hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&cache_misses, __ATOMIC_RELAXED);
+    *coalesced = __atomic_load_n(&cache_coalesced, __ATOMIC_RELAXED);
+    *bytes = 0;
+    *entries = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        *bytes += shards[i].bytes;
+        *entries += shards[i].entries;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
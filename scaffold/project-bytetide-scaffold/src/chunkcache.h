@@ -0,0 +1,81 @@
+#ifndef CHUNKCACHE_H
+#define CHUNKCACHE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "package.h"
+
+// Verified chunk bytes kept in memory for serving, keyed by the chunk's
+// digest so a removed package can never leave a stale entry behind.
+// The cache is split into shards, each an LRU list holding at most
+// config.cache_size / CACHE_SHARDS KB. Admission is TinyLFU: every
+// lookup is counted in a per-shard count-min sketch, and a chunk only
+// displaces the least recently used entry if it has been asked for
+// more often, so a one-off scan cannot flush popular chunks.
+//
+// Reads are single-flight: the first miss on a chunk claims it and
+// reads it from disk while later lookups wait for that read instead of
+// starting their own, whether or not the cache then admits the chunk.
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 1024
+#define CACHE_SKETCH_ROWS 4
+#define CACHE_SKETCH_WIDTH 4096
+// Sketch counters saturate here and are halved once this many lookups
+// have been counted, so popularity fades
+#define CACHE_SKETCH_MAX 15
+#define CACHE_SKETCH_RESET (CACHE_SKETCH_WIDTH * 8)
+
+// What cache_acquire found: the bytes, a claim on reading them that
+// must be settled with cache_fill, a read in flight it was told not to
+// wait for, or a chunk too big to read whole that the caller streams
+#define CACHE_HIT 0
+#define CACHE_CLAIMED 1
+#define CACHE_BUSY 2
+#define CACHE_MISS 3
+
+typedef struct CacheEntry {
+    uint8_t digest[DIGEST_LEN];
+    uint32_t size;
+    int shard;
+    // Holders of the entry, and whether it has left the cache; guarded
+    // by the shard lock
+    int refs;
+    int evicted;
+    struct CacheEntry *hash_next;
+    struct CacheEntry *prev;
+    struct CacheEntry *next;
+    char data[];
+} CacheEntry;
+
+// A chunk read in progress and the lookups waiting on it
+typedef struct CacheFlight {
+    uint8_t digest[DIGEST_LEN];
+    int done;
+    // The bytes read, with a reference held for the waiters, or NULL
+    // if the read failed
+    CacheEntry *entry;
+    int waiters;
+    struct CacheFlight *next;
+} CacheFlight;
+
+typedef struct {
+    pthread_mutex_t lock;
+    CacheFlight *flights;
+    pthread_cond_t landed;
+    CacheEntry *buckets[CACHE_BUCKETS];
+    // Most recently used first
+    CacheEntry *head;
+    CacheEntry *tail;
+    uint64_t bytes;
+    uint32_t entries;
+    uint8_t sketch[CACHE_SKETCH_ROWS][CACHE_SKETCH_WIDTH];
+    uint32_t samples;
+} CacheShard;
+
+void init_chunk_cache(void);
+int cache_acquire(const Package *pkg, uint32_t index, int wait, CacheEntry **entry);
+void cache_fill(const Package *pkg, uint32_t index, const char *data);
+void cache_release(CacheEntry *entry);
+void cache_stats(uint64_t *hits, uint64_t *misses, uint64_t *coalesced, uint64_t *bytes, uint32_t *entries);
+
+#endif // CHUNKCACHE_H
@@ -6,10 +6,69 @@
 #include <sys/types.h>
 #include <errno.h>
 #include <stdint.h>
+#include <arpa/inet.h>
 #include "config.h"
 
 Config config;
 
+// The bandwidth keys all take a non-negative KB figure
+static int* rate_key(const char *key) {
+    if (strcmp(key, "upload_rate") == 0) {
+        return &config.upload_rate;
+    } else if (strcmp(key, "download_rate") == 0) {
+        return &config.download_rate;
+    } else if (strcmp(key, "peer_upload_rate") == 0) {
+        return &config.peer_upload_rate;
+    } else if (strcmp(key, "peer_download_rate") == 0) {
+        return &config.peer_download_rate;
+    } else if (strcmp(key, "package_upload_rate") == 0) {
+        return &config.package_upload_rate;
+    } else if (strcmp(key, "package_download_rate") == 0) {
+        return &config.package_download_rate;
+    } else if (strcmp(key, "rate_burst") == 0) {
+        return &config.rate_burst;
+    }
+    return NULL;
+}
+
+// Adds an ip:port bootstrap peer, exits on a malformed one
+static void add_bootstrap_peer(const char *spec) {
+    char ip[16];
+    int port;
+    struct in_addr addr;
+    if (!spec || sscanf(spec, "%15[^:]:%d", ip, &port) != 2 || inet_pton(AF_INET, ip, &addr) <= 0
+        || port < 1 || port > 65535) {
+        fprintf(stderr, "Invalid bootstrap peer: %s\n", spec);
+        exit(EXIT_FAILURE);
+    }
+    if (config.bootstrap_count == CONFIG_MAX_BOOTSTRAP) {
+        fprintf(stderr, "Too many bootstrap peers\n");
+        exit(EXIT_FAILURE);
+    }
+    PeerAddress *peer = &config.bootstrap[config.bootstrap_count++];
+    strcpy(peer->ip, ip);
+    peer->port = (uint16_t)port;
+}
+
+// One ip:port per line, blank lines and # comments skipped
+static void load_peer_file(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        perror("Failed to open peer file");
+        exit(EXIT_FAILURE);
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n#")] = '\0';
+        char *spec = line + strspn(line, " \t");
+        spec[strcspn(spec, " \t")] = '\0';
+        if (*spec) {
+            add_bootstrap_peer(spec);
+        }
+    }
+    fclose(file);
+}
+
 void load_config(const char *filename) {
     FILE *file = fopen(filename, "r");
     if (file == NULL) {
@@ -17,6 +76,15 @@ void load_config(const char *filename) {
         exit(EXIT_FAILURE);
     }
 
+    config.heartbeat_interval = DEFAULT_HEARTBEAT_INTERVAL;
+    config.heartbeat_misses = DEFAULT_HEARTBEAT_MISSES;
+    config.upload_slots = DEFAULT_UPLOAD_SLOTS;
+    config.connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+    config.max_connecting = DEFAULT_MAX_CONNECTING;
+    config.disk_threads = DEFAULT_DISK_THREADS;
+    config.disk_queue_depth = DEFAULT_DISK_QUEUE_DEPTH;
+    config.cache_size = DEFAULT_CACHE_SIZE;
+
     char line[256];
     while (fgets(line, sizeof(line), file)) {
         char *key = strtok(line, ":");
@@ -36,6 +104,65 @@ void load_config(const char *filename) {
                 fprintf(stderr, "Invalid port value\n");
                 exit(5);
             }
+        } else if (strcmp(key, "heartbeat_interval") == 0) {
+            config.heartbeat_interval = atoi(value);
+            if (config.heartbeat_interval < 1) {
+                fprintf(stderr, "Invalid heartbeat_interval value\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(key, "heartbeat_misses") == 0) {
+            config.heartbeat_misses = atoi(value);
+            if (config.heartbeat_misses < 1) {
+                fprintf(stderr, "Invalid heartbeat_misses value\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(key, "upload_slots") == 0) {
+            config.upload_slots = atoi(value);
+            if (config.upload_slots < 1) {
+                fprintf(stderr, "Invalid upload_slots value\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(key, "connect_timeout") == 0) {
+            config.connect_timeout = atoi(value);
+            if (config.connect_timeout < 1) {
+                fprintf(stderr, "Invalid connect_timeout value\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(key, "max_connecting") == 0) {
+            config.max_connecting = atoi(value);
+            if (config.max_connecting < 1 || config.max_connecting > 256) {
+                fprintf(stderr, "Invalid max_connecting value\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(key, "disk_threads") == 0) {
+            config.disk_threads = atoi(value);
+            if (config.disk_threads < 1 || config.disk_threads > 64) {
+                fprintf(stderr, "Invalid disk_threads value\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(key, "disk_queue_depth") == 0) {
+            config.disk_queue_depth = atoi(value);
+            if (config.disk_queue_depth < 1) {
+                fprintf(stderr, "Invalid disk_queue_depth value\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(key, "cache_size") == 0) {
+            config.cache_size = atoi(value);
+            if (config.cache_size < 0) {
+                fprintf(stderr, "Invalid cache_size value\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(key, "peer") == 0) {
+            add_bootstrap_peer(value);
+        } else if (strcmp(key, "peer_file") == 0) {
+            load_peer_file(value);
+        } else if (rate_key(key)) {
+            int rate = atoi(value);
+            if (rate < 0) {
+                fprintf(stderr, "Invalid %s value\n", key);
+                exit(EXIT_FAILURE);
+            }
+            *rate_key(key) = rate;
         } else {
             fprintf(stderr, "Unknown configuration key: %s\n", key);
             exit(EXIT_FAILURE);
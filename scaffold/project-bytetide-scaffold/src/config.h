@@ -3,11 +3,53 @@
 
 #include <stdint.h>
 
+// Heartbeat defaults when the configuration leaves them out
+#define DEFAULT_HEARTBEAT_INTERVAL 2
+#define DEFAULT_HEARTBEAT_MISSES 3
+#define DEFAULT_UPLOAD_SLOTS 4
+#define DEFAULT_CONNECT_TIMEOUT 5
+#define DEFAULT_MAX_CONNECTING 32
+#define DEFAULT_DISK_THREADS 4
+#define DEFAULT_DISK_QUEUE_DEPTH 64
+#define DEFAULT_CACHE_SIZE 65536
+#define CONFIG_MAX_BOOTSTRAP 2048
+
+typedef struct {
+    char ip[16];
+    uint16_t port;
+} PeerAddress;
 
 typedef struct {
     char directory[256];
     int max_peers;
     uint16_t port;
+    // Seconds between PNGs, and unanswered PNGs before a peer is dropped
+    int heartbeat_interval;
+    int heartbeat_misses;
+    // Token bucket limits in KB/s for the whole node, each peer and each
+    // package, 0 for none, and the burst each bucket allows in KB
+    int upload_rate;
+    int download_rate;
+    int peer_upload_rate;
+    int peer_download_rate;
+    int package_upload_rate;
+    int package_download_rate;
+    int rate_burst;
+    // Peers we upload to at once
+    int upload_slots;
+    // Seconds an outbound connect and handshake may take, and how many
+    // may be in flight at once
+    int connect_timeout;
+    int max_connecting;
+    // Peers dialled at startup, from peer and peer_file keys, and
+    // redialled with backoff whenever we are not connected to them
+    PeerAddress bootstrap[CONFIG_MAX_BOOTSTRAP];
+    int bootstrap_count;
+    // Threads doing package file I/O, and the jobs queued across them
+    int disk_threads;
+    int disk_queue_depth;
+    // KB of verified chunk data kept in memory for serving, 0 for none
+    int cache_size;
 } Config;
 
 
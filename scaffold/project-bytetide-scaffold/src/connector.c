@@ -0,0 +1,390 @@
+// src/connector.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "config.h"
+#include "network.h"
+#include "peer.h"
+#include "connector.h"
+
+// Dials not yet started, oldest first, and the ones in flight. Only
+// the connector thread touches the active ones.
+static Dial *queue_head = NULL;
+static Dial *queue_tail = NULL;
+static Dial *active[CONNECTOR_MAX_ACTIVE];
+static int nactive = 0;
+// Dials queued or in flight, changed atomically
+static int ndials = 0;
+static pthread_mutex_t connector_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t connector_once = PTHREAD_ONCE_INIT;
+// Written to whenever a dial is queued, so poll wakes up
+static int wake_pipe[2] = { -1, -1 };
+
+static int same_dial(const Dial *dial, const char *ip, uint16_t port) {
+    return dial->port == port && strcmp(dial->ip, ip) == 0;
+}
+
+static void set_blocking(int socket, int blocking) {
+    int flags = fcntl(socket, F_GETFL, 0);
+    fcntl(socket, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+}
+
+// Frees the dial and tells whoever queued it how it went
+static void end_dial(Dial *dial, int connected) {
+    if (dial->done) {
+        dial->done(dial->done_arg, connected);
+    }
+    free(dial);
+    __atomic_sub_fetch(&ndials, 1, __ATOMIC_ACQ_REL);
+}
+
+static void fail_dial(Dial *dial, const char *reason) {
+    printf("Connection to %s:%d failed: %s\n", dial->ip, dial->port, reason);
+    if (dial->socket >= 0) {
+        close(dial->socket);
+    }
+}
+
+// Sends ACP once the socket is connected. The frame is a bare header,
+// which a fresh socket's send buffer always takes whole.
+static int send_acp(Dial *dial) {
+    struct btide_packet acp_packet = { PKT_MSG_ACP, 0, 0, {{0}} };
+    if (send_packet(dial->socket, &acp_packet) < 0) {
+        return -1;
+    }
+    dial->state = DIAL_AWAIT_ACK;
+    return 0;
+}
+
+// Starts the non-blocking connect. Returns -1 once the dial has failed.
+static int start_dial(Dial *dial) {
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(dial->port);
+    inet_pton(AF_INET, dial->ip, &serv_addr.sin_addr);
+
+    dial->socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (dial->socket < 0) {
+        fail_dial(dial, strerror(errno));
+        return -1;
+    }
+    set_blocking(dial->socket, 0);
+    dial->state = DIAL_CONNECTING;
+    dial->deadline_ms = monotonic_ms() + (uint64_t)config.connect_timeout * 1000;
+    if (connect(dial->socket, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == 0) {
+        if (send_acp(dial) < 0) {
+            fail_dial(dial, "could not send ACP");
+            return -1;
+        }
+    } else if (errno != EINPROGRESS) {
+        fail_dial(dial, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// The peer acknowledged us: it becomes a peer like any other, with its
+// reader thread servicing the connection from here on. Returns whether
+// it was taken on.
+static int finish_dial(Dial *dial) {
+    set_blocking(dial->socket, 1);
+    Peer *peer = create_peer(dial->ip, dial->port, dial->socket);
+    if (!peer) {
+        fail_dial(dial, "out of memory");
+        return 0;
+    }
+    // We dialled it, so it listens where we reached it
+    peer->listen_port = dial->port;
+    if (add_peer(peer) < 0) {
+        release_peer(peer);
+        return 0;
+    }
+    printf("Connection established with peer.\n");
+    send_pex(peer);
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, handle_client, peer);
+    pthread_detach(thread_id);
+    return 1;
+}
+
+// Moves the dial along on a poll event. Returns -1 while it is still
+// under way, otherwise whether it ended in a connected peer.
+static int advance_dial(Dial *dial, short revents) {
+    if (dial->state == DIAL_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(dial->socket, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+            err = errno;
+        }
+        if (err != 0) {
+            fail_dial(dial, strerror(err));
+            return 0;
+        }
+        if (send_acp(dial) < 0) {
+            fail_dial(dial, "could not send ACP");
+            return 0;
+        }
+        return -1;
+    }
+
+    // Read no further than the ACK header, anything after it belongs to
+    // the reader thread
+    ssize_t n = recv(dial->socket, dial->hdr + dial->got, FRAME_HDR_LEN - dial->got, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR) && !(revents & (POLLERR | POLLHUP))) {
+        return -1;
+    }
+    if (n <= 0) {
+        fail_dial(dial, "ACK not received");
+        return 0;
+    }
+    dial->got += (size_t)n;
+    if (dial->got < FRAME_HDR_LEN) {
+        return -1;
+    }
+    if (wire_get_u16(dial->hdr + 4) != PKT_MSG_ACK || wire_get_u32(dial->hdr) != 0) {
+        fail_dial(dial, "ACK not received");
+        return 0;
+    }
+    return finish_dial(dial);
+}
+
+// Starts queued dials while there is room for them
+static void fill_active(void) {
+    while (1) {
+        pthread_mutex_lock(&connector_mutex);
+        Dial *dial = NULL;
+        if (queue_head && nactive < config.max_connecting) {
+            dial = queue_head;
+            queue_head = dial->next;
+            if (!queue_head) {
+                queue_tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&connector_mutex);
+        if (!dial) {
+            return;
+        }
+        dial->next = NULL;
+        if (start_dial(dial) == 0) {
+            pthread_mutex_lock(&connector_mutex);
+            active[nactive++] = dial;
+            pthread_mutex_unlock(&connector_mutex);
+        } else {
+            end_dial(dial, 0);
+        }
+    }
+}
+
+static void drop_active(int slot) {
+    pthread_mutex_lock(&connector_mutex);
+    active[slot] = active[--nactive];
+    pthread_mutex_unlock(&connector_mutex);
+}
+
+static void* connector_worker(void *arg) {
+    (void)arg;
+    struct pollfd fds[CONNECTOR_MAX_ACTIVE + 1];
+    Dial *polled[CONNECTOR_MAX_ACTIVE];
+
+    while (1) {
+        fill_active();
+
+        uint64_t now = monotonic_ms();
+        int timeout = -1;
+        fds[0].fd = wake_pipe[0];
+        fds[0].events = POLLIN;
+        int nfds = nactive;
+        for (int i = 0; i < nfds; i++) {
+            Dial *dial = active[i];
+            polled[i] = dial;
+            fds[i + 1].fd = dial->socket;
+            fds[i + 1].events = dial->state == DIAL_CONNECTING ? POLLOUT : POLLIN;
+            fds[i + 1].revents = 0;
+            int left = dial->deadline_ms > now ? (int)(dial->deadline_ms - now) : 0;
+            if (timeout < 0 || left < timeout) {
+                timeout = left;
+            }
+        }
+
+        if (poll(fds, (nfds_t)nfds + 1, timeout) < 0 && errno != EINTR) {
+            perror("Connector poll failed");
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            char drain[64];
+            while (read(wake_pipe[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+
+        now = monotonic_ms();
+        // Walk backwards so dropping a dial never skips one
+        for (int i = nfds - 1; i >= 0; i--) {
+            Dial *dial = polled[i];
+            int connected = -1;
+            if (fds[i + 1].revents) {
+                connected = advance_dial(dial, fds[i + 1].revents);
+            } else if (now >= dial->deadline_ms) {
+                fail_dial(dial, "timed out");
+                connected = 0;
+            }
+            // queue_connect looks through the active dials, so one
+            // leaves them before it is freed
+            if (connected >= 0) {
+                drop_active(i);
+                end_dial(dial, connected);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void start_connector(void) {
+    if (pipe(wake_pipe) < 0) {
+        perror("Failed to create connector pipe");
+        exit(EXIT_FAILURE);
+    }
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, connector_worker, NULL);
+    pthread_detach(thread_id);
+}
+
+// Dials that may yet become peers
+int pending_dials(void) {
+    return __atomic_load_n(&ndials, __ATOMIC_ACQUIRE);
+}
+
+// Queues a dial to ip:port, done is called from the connector thread
+// once it ends. Returns -1 if one to the same peer is already queued or
+// in flight.
+int queue_connect(const char *ip, uint16_t port, void (*done)(void *arg, int connected), void *done_arg) {
+    pthread_once(&connector_once, start_connector);
+
+    Dial *dial = calloc(1, sizeof(Dial));
+    if (!dial) {
+        fprintf(stderr, "Failed to allocate connection attempt\n");
+        return -1;
+    }
+    strncpy(dial->ip, ip, sizeof(dial->ip) - 1);
+    dial->port = port;
+    dial->socket = -1;
+    dial->done = done;
+    dial->done_arg = done_arg;
+
+    pthread_mutex_lock(&connector_mutex);
+    int pending = 0;
+    for (Dial *it = queue_head; it && !pending; it = it->next) {
+        pending = same_dial(it, ip, port);
+    }
+    for (int i = 0; i < nactive && !pending; i++) {
+        pending = same_dial(active[i], ip, port);
+    }
+    if (pending) {
+        pthread_mutex_unlock(&connector_mutex);
+        free(dial);
+        return -1;
+    }
+    if (queue_tail) {
+        queue_tail->next = dial;
+    } else {
+        queue_head = dial;
+    }
+    queue_tail = dial;
+    __atomic_add_fetch(&ndials, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_unlock(&connector_mutex);
+
+    char wake = 1;
+    if (write(wake_pipe[1], &wake, 1) < 0 && errno != EAGAIN) {
+        perror("Failed to wake connector");
+    }
+    return 0;
+}
+
+// One entry per config.bootstrap peer
+static BootstrapState *bootstrap = NULL;
+static pthread_mutex_t bootstrap_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void bootstrap_dial_done(void *arg, int connected) {
+    BootstrapState *state = (BootstrapState *)arg;
+    uint64_t now = monotonic_ms();
+    pthread_mutex_lock(&bootstrap_mutex);
+    state->dialling = 0;
+    if (connected) {
+        state->backoff_ms = BOOTSTRAP_BACKOFF_MIN_MS;
+    } else {
+        state->next_ms = now + state->backoff_ms;
+        state->backoff_ms = state->backoff_ms * 2 > BOOTSTRAP_BACKOFF_MAX_MS
+            ? BOOTSTRAP_BACKOFF_MAX_MS : state->backoff_ms * 2;
+    }
+    pthread_mutex_unlock(&bootstrap_mutex);
+}
+
+// Dials every bootstrap peer we are not connected to whose wait is up.
+// The first pass queues them all at once, so they come up in parallel.
+static void* bootstrap_worker(void *arg) {
+    (void)arg;
+    while (1) {
+        uint64_t now = monotonic_ms();
+        for (int i = 0; i < config.bootstrap_count; i++) {
+            if (__atomic_load_n(&peer_count, __ATOMIC_ACQUIRE) >= config.max_peers) {
+                break;
+            }
+            PeerAddress *address = &config.bootstrap[i];
+            BootstrapState *state = &bootstrap[i];
+            pthread_mutex_lock(&bootstrap_mutex);
+            int due = !state->dialling && now >= state->next_ms;
+            pthread_mutex_unlock(&bootstrap_mutex);
+            if (!due) {
+                continue;
+            }
+            Peer *peer = find_peer(address->ip, address->port);
+            if (peer) {
+                release_peer(peer);
+                continue;
+            }
+            pthread_mutex_lock(&bootstrap_mutex);
+            state->dialling = 1;
+            pthread_mutex_unlock(&bootstrap_mutex);
+            if (queue_connect(address->ip, address->port, bootstrap_dial_done, state) < 0) {
+                // Someone else is dialling it, look again after a wait
+                pthread_mutex_lock(&bootstrap_mutex);
+                state->dialling = 0;
+                state->next_ms = now + state->backoff_ms;
+                pthread_mutex_unlock(&bootstrap_mutex);
+            }
+        }
+        struct timespec delay = { 0, BOOTSTRAP_TICK_MS * 1000000L };
+        nanosleep(&delay, NULL);
+    }
+    return NULL;
+}
+
+void start_bootstrap(void) {
+    if (config.bootstrap_count == 0) {
+        return;
+    }
+    bootstrap = calloc((size_t)config.bootstrap_count, sizeof(BootstrapState));
+    if (!bootstrap) {
+        fprintf(stderr, "Failed to allocate bootstrap peers\n");
+        return;
+    }
+    for (int i = 0; i < config.bootstrap_count; i++) {
+        bootstrap[i].backoff_ms = BOOTSTRAP_BACKOFF_MIN_MS;
+    }
+    printf("Connecting to %d bootstrap peers\n", config.bootstrap_count);
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, bootstrap_worker, NULL);
+    pthread_detach(thread_id);
+}
@@ -0,0 +1,49 @@
+#ifndef CONNECTOR_H
+#define CONNECTOR_H
+
+#include <stdint.h>
+#include "network.h"
+
+// Outbound connections are dialled by one thread that polls
+// non-blocking sockets through connect and the ACP/ACK handshake, at
+// most config.max_connecting at once and each within
+// config.connect_timeout seconds. The rest wait in a queue. A peer gets
+// its own reader thread only once it has acknowledged us.
+#define CONNECTOR_MAX_ACTIVE 256
+// Bootstrap peers are redialled after a failure, waiting twice as long
+// each time up to the maximum; a connect resets the wait
+#define BOOTSTRAP_BACKOFF_MIN_MS 1000
+#define BOOTSTRAP_BACKOFF_MAX_MS 60000
+#define BOOTSTRAP_TICK_MS 500
+
+typedef enum {
+    DIAL_CONNECTING,
+    DIAL_AWAIT_ACK
+} DialState;
+
+typedef struct Dial {
+    char ip[16];
+    uint16_t port;
+    int socket;
+    DialState state;
+    // The ACK frame header as it arrives
+    uint8_t hdr[FRAME_HDR_LEN];
+    size_t got;
+    uint64_t deadline_ms;
+    // Told whether the dial ended in a connected peer, may be NULL
+    void (*done)(void *arg, int connected);
+    void *done_arg;
+    struct Dial *next;
+} Dial;
+
+typedef struct {
+    uint64_t next_ms;
+    uint32_t backoff_ms;
+    int dialling;
+} BootstrapState;
+
+int queue_connect(const char *ip, uint16_t port, void (*done)(void *arg, int connected), void *done_arg);
+int pending_dials(void);
+void start_bootstrap(void);
+
+#endif // CONNECTOR_H
@@ -0,0 +1,227 @@
+// src/diskio.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "config.h"
+#include "diskio.h"
+#include "epoch.h"
+
+static DiskQueue queues[DISK_MAX_THREADS];
+static int nqueues = 0;
+static int queue_limit = 1;
+// Unbounded, so a disk thread posting to it never waits
+static DiskQueue completions;
+
+static DiskQueue* queue_for(const DiskJob *job) {
+    uint64_t key = job->pkg->fingerprint ^ ((uint64_t)job->chunk_index * 0x9e3779b97f4a7c15ull);
+    return &queues[(key >> 32) % (uint64_t)nqueues];
+}
+
+// Serves a disk queue or the completion queue. A job is dequeued and
+// its critical section entered under the queue lock, so once
+// disk_forget_package has swept a queue nothing taken from it can
+// outlive the package.
+static void* disk_worker(void *arg) {
+    DiskQueue *queue = (DiskQueue *)arg;
+    while (1) {
+        pthread_mutex_lock(&queue->lock);
+        while (!queue->head) {
+            pthread_cond_wait(&queue->ready, &queue->lock);
+        }
+        DiskJob *job = queue->head;
+        queue->head = job->next;
+        if (!queue->head) {
+            queue->tail = NULL;
+        }
+        queue->depth--;
+        pthread_cond_signal(&queue->space);
+        epoch_enter();
+        pthread_mutex_unlock(&queue->lock);
+
+        job->run(job);
+        epoch_exit();
+    }
+    return NULL;
+}
+
+void start_disk_io(void) {
+    nqueues = config.disk_threads;
+    queue_limit = config.disk_queue_depth / nqueues;
+    if (queue_limit < 1) {
+        queue_limit = 1;
+    }
+    for (int i = 0; i < nqueues; i++) {
+        DiskQueue *queue = &queues[i];
+        pthread_mutex_init(&queue->lock, NULL);
+        pthread_cond_init(&queue->ready, NULL);
+        pthread_cond_init(&queue->space, NULL);
+        pthread_t thread_id;
+        pthread_create(&thread_id, NULL, disk_worker, queue);
+        pthread_detach(thread_id);
+    }
+    pthread_mutex_init(&completions.lock, NULL);
+    pthread_cond_init(&completions.ready, NULL);
+    pthread_cond_init(&completions.space, NULL);
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, disk_worker, &completions);
+    pthread_detach(thread_id);
+}
+
+// Queues the job, once its queue has fewer than limit jobs if limit is
+// positive, or drops it if the package is already removed. Returns the
+// jobs the queue then holds. The caller
+// must hold a reference to the package or be inside an epoch critical
+// section. Removal marks the package before sweeping the queues, so
+// checking under the queue lock leaves no window for a job to slip in.
+static int enqueue(DiskQueue *queue, DiskJob *job, int limit) {
+    job->next = NULL;
+    pthread_mutex_lock(&queue->lock);
+    while (limit > 0 && queue->depth >= limit && !package_is_removed(job->pkg)) {
+        pthread_cond_wait(&queue->space, &queue->lock);
+    }
+    if (package_is_removed(job->pkg)) {
+        int depth = queue->depth;
+        pthread_mutex_unlock(&queue->lock);
+        job->drop(job);
+        return depth;
+    }
+    if (queue->tail) {
+        queue->tail->next = job;
+    } else {
+        queue->head = job;
+    }
+    queue->tail = job;
+    int depth = ++queue->depth;
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+    return depth;
+}
+
+// Queues a job for the disk thread that owns its chunk, waiting while
+// that thread's queue is full
+void disk_submit(DiskJob *job) {
+    enqueue(queue_for(job), job, queue_limit);
+}
+
+// Queues a job for the disk thread that owns its chunk without waiting,
+// past the limit if need be. Returns the queue's number if it is now
+// full, so the caller stops feeding it until disk_queue_full says it
+// has drained, or -1.
+int disk_post(DiskJob *job) {
+    DiskQueue *queue = queue_for(job);
+    if (enqueue(queue, job, 0) < queue_limit) {
+        return -1;
+    }
+    return (int)(queue - queues);
+}
+
+int disk_queue_full(int queue) {
+    pthread_mutex_lock(&queues[queue].lock);
+    int full = queues[queue].depth >= queue_limit;
+    pthread_mutex_unlock(&queues[queue].lock);
+    return full;
+}
+
+// Hands a job to the completion thread without waiting. Disk threads
+// use it for anything that talks to the peers. Completions never wait
+// on a socket, so the queue drains as fast as the disk fills it.
+void disk_complete(DiskJob *job) {
+    enqueue(&completions, job, 0);
+}
+
+typedef struct {
+    DiskJob job;
+    const struct iovec *iov;
+    int iovcnt;
+    off_t offset;
+    ssize_t result;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} DiskRead;
+
+static void finish_read(DiskRead *read, ssize_t result) {
+    pthread_mutex_lock(&read->lock);
+    read->result = result;
+    read->done = 1;
+    pthread_cond_signal(&read->cond);
+    pthread_mutex_unlock(&read->lock);
+}
+
+static void run_read(DiskJob *job) {
+    DiskRead *read = (DiskRead *)job;
+    finish_read(read, preadv(job->pkg->fd, read->iov, read->iovcnt, read->offset));
+}
+
+static void drop_read(DiskJob *job) {
+    finish_read((DiskRead *)job, -1);
+}
+
+// preadv on a disk thread, queued behind any pending writes to the
+// chunk so it never sees one half done. The caller still waits for it:
+// reads are ordered against writes, not made asynchronous. Only upload
+// threads read, and none of them has anything to send until it is in.
+ssize_t disk_preadv(Package *pkg, uint32_t chunk_index, const struct iovec *iov, int iovcnt, off_t offset) {
+    DiskRead read;
+    memset(&read, 0, sizeof(read));
+    read.job.run = run_read;
+    read.job.drop = drop_read;
+    read.job.pkg = pkg;
+    read.job.chunk_index = chunk_index;
+    read.iov = iov;
+    read.iovcnt = iovcnt;
+    read.offset = offset;
+    pthread_mutex_init(&read.lock, NULL);
+    pthread_cond_init(&read.cond, NULL);
+
+    disk_submit(&read.job);
+    pthread_mutex_lock(&read.lock);
+    while (!read.done) {
+        pthread_cond_wait(&read.cond, &read.lock);
+    }
+    pthread_mutex_unlock(&read.lock);
+
+    pthread_mutex_destroy(&read.lock);
+    pthread_cond_destroy(&read.cond);
+    return read.result;
+}
+
+static void forget_in_queue(DiskQueue *queue, Package *pkg) {
+    DiskJob *dropped = NULL;
+    pthread_mutex_lock(&queue->lock);
+    DiskJob **link = &queue->head;
+    queue->tail = NULL;
+    while (*link) {
+        DiskJob *job = *link;
+        if (job->pkg == pkg) {
+            *link = job->next;
+            job->next = dropped;
+            dropped = job;
+            queue->depth--;
+        } else {
+            queue->tail = job;
+            link = &job->next;
+        }
+    }
+    pthread_cond_broadcast(&queue->space);
+    pthread_mutex_unlock(&queue->lock);
+
+    while (dropped) {
+        DiskJob *job = dropped;
+        dropped = job->next;
+        job->drop(job);
+    }
+}
+
+// Drops every queued job for a package that is being removed, from the
+// disk queues and the completion queue alike
+void disk_forget_package(Package *pkg) {
+    for (int i = 0; i < nqueues; i++) {
+        forget_in_queue(&queues[i], pkg);
+    }
+    forget_in_queue(&completions, pkg);
+}
@@ -0,0 +1,52 @@
+#ifndef DISKIO_H
+#define DISKIO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include "package.h"
+
+// Package file writes run on a pool of disk threads so the reader
+// threads servicing sockets never wait on storage. Reads go through the
+// same queues to stay ordered behind writes, but their callers wait. Each thread
+// owns a queue of at most config.disk_queue_depth / config.disk_threads
+// jobs. disk_submit blocks while its queue is full; disk_post never
+// waits and says so instead, for callers that can push back on whoever
+// feeds them. Jobs are spread by
+// package and chunk, so everything touching one chunk runs in order.
+// What follows a disk operation and involves the peers is handed to a
+// separate completion thread, which posts its frames rather than
+// sending them, so a slow peer stalls neither the disk nor the others.
+#define DISK_MAX_THREADS 64
+
+typedef struct DiskJob {
+    // Runs on a disk thread inside an epoch critical section and owns
+    // the job from then on
+    void (*run)(struct DiskJob *job);
+    // Called instead of run if the package is removed while the job is
+    // still queued
+    void (*drop)(struct DiskJob *job);
+    Package *pkg;
+    uint32_t chunk_index;
+    struct DiskJob *next;
+} DiskJob;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+    DiskJob *head;
+    DiskJob *tail;
+    int depth;
+} DiskQueue;
+
+void start_disk_io(void);
+void disk_submit(DiskJob *job);
+int disk_post(DiskJob *job);
+int disk_queue_full(int queue);
+void disk_complete(DiskJob *job);
+ssize_t disk_preadv(Package *pkg, uint32_t chunk_index, const struct iovec *iov, int iovcnt, off_t offset);
+void disk_forget_package(Package *pkg);
+
+#endif // DISKIO_H
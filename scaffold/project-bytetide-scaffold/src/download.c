@@ -0,0 +1,692 @@
+// src/download.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "network.h"
+#include "download.h"
+
+// Active downloads. Event handlers find their download under
+// downloads_mutex and lock it before letting go of the list, so a
+// finished download can be unlinked and freed safely.
+static Download *downloads = NULL;
+static pthread_mutex_t downloads_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    Peer *peer;
+    uint16_t handle;
+    uint32_t index;
+} ChunkRequest;
+
+static int has_chunk(const DownloadPeer *dp, uint32_t index) {
+    return (dp->have[index / 8] >> (index % 8)) & 1;
+}
+
+static int is_requested(const DownloadPeer *dp, uint32_t index) {
+    return (dp->requested[index / 8] >> (index % 8)) & 1;
+}
+
+// Puts a chunk on the ring for its availability, at the front or the
+// back at random so ties spread across the swarm
+static void bucket_insert(Download *d, uint32_t index) {
+    uint32_t *head = &d->bucket_head[d->avail[index]];
+    if (*head == DOWNLOAD_NO_CHUNK) {
+        d->bucket_next[index] = index;
+        d->bucket_prev[index] = index;
+        *head = index;
+    } else {
+        uint32_t next = *head;
+        uint32_t prev = d->bucket_prev[next];
+        d->bucket_next[index] = next;
+        d->bucket_prev[index] = prev;
+        d->bucket_next[prev] = index;
+        d->bucket_prev[next] = index;
+        if (rand() & 1) {
+            *head = index;
+        }
+    }
+    d->bucketed[index] = 1;
+}
+
+static void bucket_remove(Download *d, uint32_t index) {
+    if (!d->bucketed[index]) {
+        return;
+    }
+    uint32_t *head = &d->bucket_head[d->avail[index]];
+    uint32_t next = d->bucket_next[index];
+    if (next == index) {
+        *head = DOWNLOAD_NO_CHUNK;
+    } else {
+        uint32_t prev = d->bucket_prev[index];
+        d->bucket_next[prev] = next;
+        d->bucket_prev[next] = prev;
+        if (*head == index) {
+            *head = next;
+        }
+    }
+    d->bucketed[index] = 0;
+}
+
+static void set_have(Download *d, DownloadPeer *dp, uint32_t index, int has) {
+    if (has_chunk(dp, index) == has) {
+        return;
+    }
+    int bucketed = d->bucketed[index];
+    bucket_remove(d, index);
+    if (has) {
+        dp->have[index / 8] |= (uint8_t)(1 << (index % 8));
+        d->avail[index]++;
+    } else {
+        dp->have[index / 8] &= (uint8_t)~(1 << (index % 8));
+        d->avail[index]--;
+    }
+    if (bucketed) {
+        bucket_insert(d, index);
+    }
+}
+
+static DownloadPeer* download_peer_of(Download *d, Peer *peer) {
+    for (int i = 0; i < d->npeers; i++) {
+        if (d->peers[i]->peer == peer) {
+            return d->peers[i];
+        }
+    }
+    return NULL;
+}
+
+// Returns the locked download for pkg, or NULL
+static Download* lock_download(Package *pkg) {
+    pthread_mutex_lock(&downloads_mutex);
+    Download *d = downloads;
+    while (d && d->pkg != pkg) {
+        d = d->next;
+    }
+    if (d) {
+        pthread_mutex_lock(&d->lock);
+    }
+    pthread_mutex_unlock(&downloads_mutex);
+    return d;
+}
+
+// Requests only ever go out at the current time, so appending keeps
+// the age list oldest first
+static void age_append(Download *d, uint32_t index) {
+    d->age_prev[index] = d->age_tail;
+    d->age_next[index] = DOWNLOAD_NO_CHUNK;
+    if (d->age_tail == DOWNLOAD_NO_CHUNK) {
+        d->age_head = index;
+    } else {
+        d->age_next[d->age_tail] = index;
+    }
+    d->age_tail = index;
+}
+
+static void age_remove(Download *d, uint32_t index) {
+    uint32_t next = d->age_next[index];
+    uint32_t prev = d->age_prev[index];
+    if (prev == DOWNLOAD_NO_CHUNK) {
+        d->age_head = next;
+    } else {
+        d->age_next[prev] = next;
+    }
+    if (next == DOWNLOAD_NO_CHUNK) {
+        d->age_tail = prev;
+    } else {
+        d->age_prev[next] = prev;
+    }
+}
+
+static void add_request(Download *d, DownloadPeer *dp, uint32_t index, uint64_t now) {
+    dp->requested[index / 8] |= (uint8_t)(1 << (index % 8));
+    dp->request_list[dp->outstanding++] = index;
+    if (d->pending[index]++ == 0) {
+        d->requested_at[index] = now;
+        bucket_remove(d, index);
+        age_append(d, index);
+    }
+}
+
+static void release_request(Download *d, DownloadPeer *dp, uint32_t index) {
+    if (!is_requested(dp, index)) {
+        return;
+    }
+    dp->requested[index / 8] &= (uint8_t)~(1 << (index % 8));
+    for (int i = 0; i < dp->outstanding; i++) {
+        if (dp->request_list[i] == index) {
+            dp->request_list[i] = dp->request_list[--dp->outstanding];
+            break;
+        }
+    }
+    if (--d->pending[index] == 0) {
+        age_remove(d, index);
+        if (!chunk_is_complete(d->pkg, index)) {
+            bucket_insert(d, index);
+        }
+    }
+    if (d->writer[index] == dp) {
+        d->writer[index] = NULL;
+    }
+}
+
+// Withdraws a chunk from every peer it is requested from
+static void release_all_requests(Download *d, uint32_t index) {
+    for (int p = 0; p < d->npeers && d->pending[index]; p++) {
+        release_request(d, d->peers[p], index);
+    }
+}
+
+static void free_download_peer(DownloadPeer *dp) {
+    free(dp->have);
+    free(dp->requested);
+    free(dp);
+}
+
+// Withdraws everything requested from the peer
+static void release_peer_requests(Download *d, DownloadPeer *dp) {
+    while (dp->outstanding > 0) {
+        release_request(d, dp, dp->request_list[dp->outstanding - 1]);
+    }
+}
+
+static void drop_download_peer(Download *d, int slot) {
+    DownloadPeer *dp = d->peers[slot];
+    release_peer_requests(d, dp);
+    // Whole bytes of chunks the peer lacks are skipped
+    for (uint32_t b = 0; b < (d->pkg->nchunks + 7) / 8; b++) {
+        for (uint32_t i = b * 8; dp->have[b] && i < b * 8 + 8; i++) {
+            set_have(d, dp, i, 0);
+        }
+    }
+    d->peers[slot] = d->peers[--d->npeers];
+    release_peer(dp->peer);
+    free_download_peer(dp);
+}
+
+static int peer_is_closing(Peer *peer) {
+    pthread_mutex_lock(&peer->state_lock);
+    int closing = peer->closing;
+    pthread_mutex_unlock(&peer->state_lock);
+    return closing;
+}
+
+// Replaces what we believe dp holds with what it last advertised
+static void refresh_have(Download *d, DownloadPeer *dp, uint8_t *scratch) {
+    if (!peer_copy_have(dp->peer, d->pkg, scratch)) {
+        return;
+    }
+    for (uint32_t c = 0; c < d->pkg->nchunks; c++) {
+        set_have(d, dp, c, (scratch[c / 8] >> (c % 8)) & 1);
+    }
+}
+
+// Brings every connected peer into the download. Binding sends a
+// packet, so it happens before taking the download lock.
+static void sync_peers(Download *d) {
+    Peer *snapshot[DOWNLOAD_MAX_PEERS];
+    int count = snapshot_peers(snapshot, DOWNLOAD_MAX_PEERS);
+
+    for (int i = 0; i < count; i++) {
+        Peer *peer = snapshot[i];
+        pthread_mutex_lock(&d->lock);
+        int known = download_peer_of(d, peer) != NULL;
+        pthread_mutex_unlock(&d->lock);
+
+        uint16_t handle = PEER_NO_HANDLE;
+        if (!known && !peer_is_closing(peer)) {
+            handle = peer_bind_package(peer, d->pkg);
+        }
+        DownloadPeer *dp = NULL;
+        if (handle != PEER_NO_HANDLE) {
+            dp = calloc(1, sizeof(DownloadPeer));
+            if (dp) {
+                dp->have = calloc((d->pkg->nchunks + 7) / 8 + 1, 1);
+                dp->requested = calloc((d->pkg->nchunks + 7) / 8 + 1, 1);
+            }
+        }
+        if (!dp || !dp->have || !dp->requested) {
+            if (dp) {
+                free_download_peer(dp);
+            }
+            release_peer(peer);
+            continue;
+        }
+
+        dp->peer = peer;
+        dp->handle = handle;
+        pthread_mutex_lock(&d->lock);
+        if (d->npeers < DOWNLOAD_MAX_PEERS) {
+            // A peer holds nothing until its bitfield arrives. Copying
+            // under the lock means a bitfield landing meanwhile is seen
+            // either here or by download_peer_bitfield.
+            refresh_have(d, dp, d->scratch);
+            d->peers[d->npeers++] = dp;
+            dp = NULL;
+        }
+        pthread_mutex_unlock(&d->lock);
+        if (dp) {
+            release_peer(peer);
+            free_download_peer(dp);
+        }
+    }
+}
+
+// Rarest first: among chunks the peer holds that are neither complete
+// nor already requested, pick the one the fewest peers hold, walking
+// the availability rings up from the rarest. In the endgame a requested
+// chunk may be asked of other peers too, least requested first.
+static int pick_chunk(Download *d, DownloadPeer *dp) {
+    if (d->endgame) {
+        int best = -1;
+        for (int k = 0; k < d->nendgame; k++) {
+            uint32_t i = d->endgame_chunks[k];
+            if (d->pending[i] >= DOWNLOAD_ENDGAME_FANOUT || is_requested(dp, i)
+                || !has_chunk(dp, i) || chunk_is_complete(d->pkg, i)) {
+                continue;
+            }
+            if (best < 0 || d->pending[i] < d->pending[best]
+                || (d->pending[i] == d->pending[best] && d->avail[i] < d->avail[best])) {
+                best = (int)i;
+            }
+        }
+        return best;
+    }
+    for (int a = 1; a <= d->npeers; a++) {
+        uint32_t head = d->bucket_head[a];
+        if (head == DOWNLOAD_NO_CHUNK) {
+            continue;
+        }
+        uint32_t i = head;
+        do {
+            if (has_chunk(dp, i) && !chunk_is_complete(d->pkg, i)) {
+                return (int)i;
+            }
+            i = d->bucket_next[i];
+        } while (i != head);
+    }
+    return -1;
+}
+
+// Notes the few chunks still missing, which the endgame picks among
+static void enter_endgame(Download *d) {
+    d->endgame = 1;
+    d->nendgame = 0;
+    for (uint32_t i = 0; i < d->pkg->nchunks && d->nendgame < DOWNLOAD_ENDGAME_CHUNKS; i++) {
+        if (!chunk_is_complete(d->pkg, i)) {
+            d->endgame_chunks[d->nendgame++] = i;
+        }
+    }
+}
+
+static uint32_t missing_chunks(const Package *pkg) {
+    return pkg->nchunks - __atomic_load_n(&pkg->completed_count, __ATOMIC_ACQUIRE);
+}
+
+static void free_download(Download *d) {
+    while (d->npeers > 0) {
+        drop_download_peer(d, d->npeers - 1);
+    }
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->cond);
+    free(d->avail);
+    free(d->pending);
+    free(d->requested_at);
+    free(d->writer);
+    free(d->age_next);
+    free(d->age_prev);
+    free(d->bucket_next);
+    free(d->bucket_prev);
+    free(d->bucketed);
+    free(d->scratch);
+    free(d);
+}
+
+static void* download_worker(void* arg) {
+    Download *d = (Download*)arg;
+    ChunkRequest *requests = malloc(sizeof(ChunkRequest) * DOWNLOAD_MAX_PEERS * PEER_WINDOW_MAX);
+    Peer **interests = malloc(sizeof(Peer *) * DOWNLOAD_MAX_PEERS);
+    if (!requests || !interests) {
+        fprintf(stderr, "Failed to allocate download request buffer\n");
+        d->stopped = 1;
+    }
+
+    while (!d->stopped && !package_is_complete(d->pkg)) {
+        sync_peers(d);
+
+        int nreq = 0;
+        pthread_mutex_lock(&d->lock);
+        uint64_t now = monotonic_ms();
+        for (int i = d->npeers - 1; i >= 0; i--) {
+            if (peer_is_closing(d->peers[i]->peer)) {
+                drop_download_peer(d, i);
+            }
+        }
+        while (d->age_head != DOWNLOAD_NO_CHUNK && now - d->requested_at[d->age_head] > DOWNLOAD_TIMEOUT * 1000) {
+            uint32_t i = d->age_head;
+            for (int p = 0; p < d->npeers; p++) {
+                if (is_requested(d->peers[p], i)) {
+                    peer_request_timeout(d->peers[p]->peer, now);
+                }
+            }
+            release_all_requests(d, i);
+        }
+        if (!d->endgame && missing_chunks(d->pkg) <= DOWNLOAD_ENDGAME_CHUNKS) {
+            enter_endgame(d);
+            printf("Download of %s entering endgame\n", d->pkg->ident);
+        }
+        int ninterest = 0;
+        for (int p = 0; p < d->npeers; p++) {
+            DownloadPeer *dp = d->peers[p];
+            // A choking peer only hears that we still want something
+            if (peer_is_choking_us(dp->peer)) {
+                if (pick_chunk(d, dp) >= 0 && peer_interest_due(dp->peer, now)) {
+                    retain_peer(dp->peer);
+                    interests[ninterest++] = dp->peer;
+                }
+                continue;
+            }
+            int window = peer_request_window(dp->peer);
+            while (dp->outstanding < window) {
+                int index = pick_chunk(d, dp);
+                if (index < 0) {
+                    break;
+                }
+                add_request(d, dp, (uint32_t)index, now);
+                retain_peer(dp->peer);
+                requests[nreq].peer = dp->peer;
+                requests[nreq].handle = dp->handle;
+                requests[nreq].index = (uint32_t)index;
+                nreq++;
+            }
+        }
+        pthread_mutex_unlock(&d->lock);
+
+        // Sending can block on a slow socket, never do it under the lock
+        for (int i = 0; i < nreq; i++) {
+            Chunk *chunk = &d->pkg->chunks[requests[i].index];
+            struct req_packet req = { PKT_MSG_REQ, PKT_ERR_NONE, requests[i].handle, requests[i].index, chunk->offset, 0 };
+            send_req_packet(requests[i].peer, &req);
+            release_peer(requests[i].peer);
+        }
+        for (int i = 0; i < ninterest; i++) {
+            send_interest(interests[i]);
+            release_peer(interests[i]);
+        }
+
+        pthread_mutex_lock(&d->lock);
+        if (!d->stopped && !package_is_complete(d->pkg)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&d->cond, &d->lock, &deadline);
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    if (!d->stopped && package_is_complete(d->pkg)) {
+        printf("Download of %s complete\n", d->pkg->ident);
+    }
+
+    pthread_mutex_lock(&downloads_mutex);
+    Download **link = &downloads;
+    while (*link && *link != d) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = d->next;
+    }
+    pthread_mutex_unlock(&downloads_mutex);
+    // Wait out any event handler that found d before it was unlinked
+    pthread_mutex_lock(&d->lock);
+    pthread_mutex_unlock(&d->lock);
+
+    Package *pkg = d->pkg;
+    free(requests);
+    free(interests);
+    free_download(d);
+    release_package(pkg);
+    return NULL;
+}
+
+int start_download(Package *pkg) {
+    if (package_is_complete(pkg)) {
+        printf("Package is already complete.\n");
+        return -1;
+    }
+
+    Download *d = calloc(1, sizeof(Download));
+    if (!d) {
+        fprintf(stderr, "Failed to allocate download\n");
+        return -1;
+    }
+    d->pkg = pkg;
+    d->avail = calloc(pkg->nchunks, sizeof(uint16_t));
+    d->pending = calloc(pkg->nchunks, sizeof(uint8_t));
+    d->requested_at = calloc(pkg->nchunks, sizeof(uint64_t));
+    d->writer = calloc(pkg->nchunks, sizeof(DownloadPeer *));
+    d->age_next = calloc(pkg->nchunks, sizeof(uint32_t));
+    d->age_prev = calloc(pkg->nchunks, sizeof(uint32_t));
+    d->bucket_next = calloc(pkg->nchunks, sizeof(uint32_t));
+    d->bucket_prev = calloc(pkg->nchunks, sizeof(uint32_t));
+    d->bucketed = calloc(pkg->nchunks, sizeof(uint8_t));
+    d->scratch = calloc((pkg->nchunks + 7) / 8 + 1, 1);
+    if (!d->avail || !d->pending || !d->requested_at || !d->writer || !d->age_next || !d->age_prev
+        || !d->bucket_next || !d->bucket_prev || !d->bucketed || !d->scratch) {
+        fprintf(stderr, "Failed to allocate download\n");
+        free(d->avail);
+        free(d->pending);
+        free(d->requested_at);
+        free(d->writer);
+        free(d->age_next);
+        free(d->age_prev);
+        free(d->bucket_next);
+        free(d->bucket_prev);
+        free(d->bucketed);
+        free(d->scratch);
+        free(d);
+        return -1;
+    }
+    d->age_head = DOWNLOAD_NO_CHUNK;
+    d->age_tail = DOWNLOAD_NO_CHUNK;
+    for (int a = 0; a <= DOWNLOAD_MAX_PEERS; a++) {
+        d->bucket_head[a] = DOWNLOAD_NO_CHUNK;
+    }
+    for (uint32_t i = 0; i < pkg->nchunks; i++) {
+        if (!chunk_is_complete(pkg, i)) {
+            bucket_insert(d, i);
+        }
+    }
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->cond, NULL);
+
+    pthread_mutex_lock(&downloads_mutex);
+    for (Download *it = downloads; it; it = it->next) {
+        if (it->pkg == pkg) {
+            pthread_mutex_unlock(&downloads_mutex);
+            printf("Package is already downloading.\n");
+            free_download(d);
+            return -1;
+        }
+    }
+    d->next = downloads;
+    downloads = d;
+    pthread_mutex_unlock(&downloads_mutex);
+
+    // The worker blocks on sockets, so it keeps the package alive with
+    // a reference rather than an epoch critical section
+    retain_package(pkg);
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, download_worker, d);
+    pthread_detach(thread_id);
+    return 0;
+}
+
+int download_is_active(Package *pkg) {
+    Download *d = lock_download(pkg);
+    if (d) {
+        pthread_mutex_unlock(&d->lock);
+    }
+    return d != NULL;
+}
+
+// Whether chunk data from peer may be written. The first peer the chunk
+// is requested from to send its first byte becomes its only writer,
+// which also shuts out late data from a request that already timed out.
+// Packages without a download accept everything.
+int download_accept_data(Peer *peer, Package *pkg, uint32_t index, uint32_t offset) {
+    Download *d = lock_download(pkg);
+    if (!d) {
+        return 1;
+    }
+    DownloadPeer *dp = download_peer_of(d, peer);
+    int accept = 1;
+    if (dp) {
+        if (!d->writer[index] && is_requested(dp, index) && offset == pkg->chunks[index].offset) {
+            d->writer[index] = dp;
+        }
+        accept = d->writer[index] == dp;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return accept;
+}
+
+// A chunk verified. Any other peer it was requested from during the
+// endgame is told to skip it.
+void download_chunk_done(Peer *peer, Package *pkg, uint32_t index) {
+    Download *d = lock_download(pkg);
+    if (!d) {
+        return;
+    }
+    ChunkRequest cancels[DOWNLOAD_ENDGAME_FANOUT];
+    int ncancel = 0;
+    bucket_remove(d, index);
+    for (int p = 0; p < d->npeers; p++) {
+        DownloadPeer *dp = d->peers[p];
+        if (!is_requested(dp, index)) {
+            continue;
+        }
+        if (dp->peer == peer) {
+            uint64_t now = monotonic_ms();
+            peer_request_done(peer, pkg->chunks[index].size, now - d->requested_at[index], now);
+        } else if (ncancel < DOWNLOAD_ENDGAME_FANOUT) {
+            retain_peer(dp->peer);
+            cancels[ncancel].peer = dp->peer;
+            cancels[ncancel].handle = dp->handle;
+            cancels[ncancel].index = index;
+            ncancel++;
+        }
+        release_request(d, dp, index);
+    }
+    pthread_cond_signal(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+
+    for (int i = 0; i < ncancel; i++) {
+        send_can_packet(cancels[i].peer, cancels[i].handle, cancels[i].index);
+        release_peer(cancels[i].peer);
+    }
+}
+
+// The peer could not give us a good copy of the chunk, either because
+// it does not hold it or because what it sent did not verify. Returns
+// 0 if no download is managing the package.
+int download_chunk_failed(Peer *peer, Package *pkg, uint32_t index) {
+    Download *d = lock_download(pkg);
+    if (!d) {
+        return 0;
+    }
+    DownloadPeer *dp = download_peer_of(d, peer);
+    if (dp && d->writer[index] == dp) {
+        // What the others sent was dropped, so ask afresh
+        set_have(d, dp, index, 0);
+        release_all_requests(d, index);
+    } else if (dp) {
+        set_have(d, dp, index, 0);
+        release_request(d, dp, index);
+    }
+    pthread_cond_signal(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+    return 1;
+}
+
+// The peer sent (part of) its bitfield for pkg
+void download_peer_bitfield(Peer *peer, Package *pkg) {
+    Download *d = lock_download(pkg);
+    if (!d) {
+        return;
+    }
+    DownloadPeer *dp = download_peer_of(d, peer);
+    if (dp) {
+        refresh_have(d, dp, d->scratch);
+        pthread_cond_signal(&d->cond);
+    }
+    pthread_mutex_unlock(&d->lock);
+}
+
+// The peer verified another chunk of pkg
+void download_peer_have(Peer *peer, Package *pkg, uint32_t index) {
+    Download *d = lock_download(pkg);
+    if (!d) {
+        return;
+    }
+    DownloadPeer *dp = download_peer_of(d, peer);
+    if (dp && !has_chunk(dp, index)) {
+        set_have(d, dp, index, 1);
+        pthread_cond_signal(&d->cond);
+    }
+    pthread_mutex_unlock(&d->lock);
+}
+
+// The peer stopped serving us; what we asked of it goes to others
+void download_peer_choked(Peer *peer) {
+    pthread_mutex_lock(&downloads_mutex);
+    for (Download *d = downloads; d; d = d->next) {
+        pthread_mutex_lock(&d->lock);
+        DownloadPeer *dp = download_peer_of(d, peer);
+        if (dp) {
+            release_peer_requests(d, dp);
+        }
+        pthread_cond_signal(&d->cond);
+        pthread_mutex_unlock(&d->lock);
+    }
+    pthread_mutex_unlock(&downloads_mutex);
+}
+
+void download_peer_unchoked(Peer *peer) {
+    (void)peer;
+    pthread_mutex_lock(&downloads_mutex);
+    for (Download *d = downloads; d; d = d->next) {
+        pthread_mutex_lock(&d->lock);
+        pthread_cond_signal(&d->cond);
+        pthread_mutex_unlock(&d->lock);
+    }
+    pthread_mutex_unlock(&downloads_mutex);
+}
+
+void download_peer_gone(Peer *peer) {
+    pthread_mutex_lock(&downloads_mutex);
+    for (Download *d = downloads; d; d = d->next) {
+        pthread_mutex_lock(&d->lock);
+        for (int i = 0; i < d->npeers; i++) {
+            if (d->peers[i]->peer == peer) {
+                drop_download_peer(d, i);
+                break;
+            }
+        }
+        pthread_cond_signal(&d->cond);
+        pthread_mutex_unlock(&d->lock);
+    }
+    pthread_mutex_unlock(&downloads_mutex);
+}
+
+// The package is being removed; the worker winds down at its next look
+void download_package_removed(Package *pkg) {
+    Download *d = lock_download(pkg);
+    if (!d) {
+        return;
+    }
+    d->stopped = 1;
+    pthread_cond_signal(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+}
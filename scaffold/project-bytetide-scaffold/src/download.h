@@ -0,0 +1,79 @@
+#ifndef DOWNLOAD_H
+#define DOWNLOAD_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "package.h"
+#include "peer.h"
+
+// Seconds before an unanswered chunk request is handed to someone else
+#define DOWNLOAD_TIMEOUT 10
+#define DOWNLOAD_MAX_PEERS 2048
+// Once this few chunks are missing, each may be requested from several
+// peers at once; the first copy to verify wins and the rest are cancelled
+#define DOWNLOAD_ENDGAME_CHUNKS 16
+#define DOWNLOAD_ENDGAME_FANOUT 3
+#define DOWNLOAD_NO_CHUNK UINT32_MAX
+
+// What one connected peer can do for one download
+typedef struct {
+    Peer *peer;
+    uint16_t handle;
+    // Chunks we believe the peer holds
+    uint8_t *have;
+    // Chunks currently requested from the peer, bounded by its window,
+    // as a bitmap and as a list of outstanding entries
+    uint8_t *requested;
+    uint32_t request_list[PEER_WINDOW_MAX];
+    int outstanding;
+} DownloadPeer;
+
+typedef struct Download {
+    Package *pkg;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    DownloadPeer *peers[DOWNLOAD_MAX_PEERS];
+    int npeers;
+    // Per chunk: how many peers hold it, how many it is requested from,
+    // and when the first of those requests went out (monotonic ms)
+    uint16_t *avail;
+    uint8_t *pending;
+    uint64_t *requested_at;
+    // Chunks with requests out, oldest first, so timeouts are found
+    // without scanning every chunk
+    uint32_t *age_next;
+    uint32_t *age_prev;
+    uint32_t age_head;
+    uint32_t age_tail;
+    // The requested peer whose data is being written for each chunk;
+    // copies from the others are dropped so streams never interleave
+    DownloadPeer **writer;
+    // Missing chunks nobody has been asked for, on one ring per
+    // availability so the rarest are found without scanning them all
+    uint32_t bucket_head[DOWNLOAD_MAX_PEERS + 1];
+    uint32_t *bucket_next;
+    uint32_t *bucket_prev;
+    uint8_t *bucketed;
+    // The chunks still missing when the endgame began
+    uint32_t endgame_chunks[DOWNLOAD_ENDGAME_CHUNKS];
+    int nendgame;
+    // Bitmap sized buffer for copying peer availability, under lock
+    uint8_t *scratch;
+    int endgame;
+    int stopped;
+    struct Download *next;
+} Download;
+
+int start_download(Package *pkg);
+int download_is_active(Package *pkg);
+int download_accept_data(Peer *peer, Package *pkg, uint32_t index, uint32_t offset);
+void download_chunk_done(Peer *peer, Package *pkg, uint32_t index);
+int download_chunk_failed(Peer *peer, Package *pkg, uint32_t index);
+void download_peer_bitfield(Peer *peer, Package *pkg);
+void download_peer_have(Peer *peer, Package *pkg, uint32_t index);
+void download_peer_choked(Peer *peer);
+void download_peer_unchoked(Peer *peer);
+void download_peer_gone(Peer *peer);
+void download_package_removed(Package *pkg);
+
+#endif // DOWNLOAD_H
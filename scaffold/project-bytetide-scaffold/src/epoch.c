@@ -0,0 +1,157 @@
+// src/epoch.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "epoch.h"
+
+typedef struct {
+    // The epoch a thread entered at, shifted up, with the low bit set
+    // while it is inside a critical section; 0 outside
+    uint64_t state;
+    int used;
+} EpochSlot;
+
+typedef struct Retired {
+    void (*destroy)(void *);
+    void *ptr;
+    uint64_t epoch;
+    struct Retired *next;
+} Retired;
+
+static EpochSlot slots[EPOCH_MAX_THREADS];
+// One past the highest slot ever claimed, so scans stay short
+static int slot_limit = 0;
+static uint64_t global_epoch = 1;
+static Retired *retired = NULL;
+static pthread_mutex_t retire_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+static pthread_once_t reclaimer_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+
+static __thread int thread_slot = -1;
+static __thread int thread_depth = 0;
+
+// Hands a slot back when its thread exits. Keys hold slot + 1, since a
+// NULL value never reaches the destructor.
+static void release_slot(void *arg) {
+    int slot = (int)(intptr_t)arg - 1;
+    __atomic_store_n(&slots[slot].state, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&slots[slot].used, 0, __ATOMIC_RELEASE);
+}
+
+static void create_slot_key(void) {
+    pthread_key_create(&slot_key, release_slot);
+}
+
+static int claim_slot(void) {
+    pthread_once(&slot_key_once, create_slot_key);
+    for (int i = 0; i < EPOCH_MAX_THREADS; i++) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&slots[i].used, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            int limit = __atomic_load_n(&slot_limit, __ATOMIC_RELAXED);
+            while (limit <= i && !__atomic_compare_exchange_n(&slot_limit, &limit, i + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            }
+            pthread_setspecific(slot_key, (void *)(intptr_t)(i + 1));
+            return i;
+        }
+    }
+    fprintf(stderr, "Out of epoch slots\n");
+    abort();
+}
+
+// Critical sections nest; only the outermost one announces itself
+void epoch_enter(void) {
+    if (thread_depth++ > 0) {
+        return;
+    }
+    if (thread_slot < 0) {
+        thread_slot = claim_slot();
+    }
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&slots[thread_slot].state, epoch << 1 | 1, __ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void) {
+    if (--thread_depth > 0) {
+        return;
+    }
+    __atomic_store_n(&slots[thread_slot].state, 0, __ATOMIC_RELEASE);
+}
+
+// The epoch moves on once every thread inside a critical section has
+// entered at the current one. Caller holds retire_mutex.
+static void try_advance(void) {
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    int limit = __atomic_load_n(&slot_limit, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < limit; i++) {
+        uint64_t state = __atomic_load_n(&slots[i].state, __ATOMIC_SEQ_CST);
+        if ((state & 1) && state >> 1 != epoch) {
+            return;
+        }
+    }
+    __atomic_store_n(&global_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+}
+
+// Anything retired during epoch e was unreachable to threads entering
+// at e + 1, so once the epoch reaches e + 2 nobody can still hold it
+static void* reclaimer(void *arg) {
+    (void)arg;
+    while (1) {
+        struct timespec delay = { 0, EPOCH_RECLAIM_MS * 1000000L };
+        nanosleep(&delay, NULL);
+
+        Retired *ready = NULL;
+        pthread_mutex_lock(&retire_mutex);
+        if (retired) {
+            try_advance();
+        }
+        uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+        Retired **link = &retired;
+        while (*link) {
+            Retired *r = *link;
+            if (r->epoch + 2 <= epoch) {
+                *link = r->next;
+                r->next = ready;
+                ready = r;
+            } else {
+                link = &r->next;
+            }
+        }
+        pthread_mutex_unlock(&retire_mutex);
+
+        while (ready) {
+            Retired *r = ready;
+            ready = r->next;
+            r->destroy(r->ptr);
+            free(r);
+        }
+    }
+    return NULL;
+}
+
+static void start_reclaimer(void) {
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, reclaimer, NULL);
+    pthread_detach(thread_id);
+}
+
+// Frees ptr with destroy once no reader can still see it. The caller
+// must already have made it unreachable.
+void epoch_retire(void (*destroy)(void *), void *ptr) {
+    Retired *r = malloc(sizeof(Retired));
+    if (!r) {
+        fprintf(stderr, "Failed to allocate retired object, leaking it\n");
+        return;
+    }
+    r->destroy = destroy;
+    r->ptr = ptr;
+    pthread_mutex_lock(&retire_mutex);
+    r->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    r->next = retired;
+    retired = r;
+    pthread_mutex_unlock(&retire_mutex);
+    pthread_once(&reclaimer_once, start_reclaimer);
+}
@@ -0,0 +1,19 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdint.h>
+
+// Epoch based reclamation. Threads that follow shared pointers without
+// a lock do so between epoch_enter and epoch_exit. Something unpublished
+// and handed to epoch_retire is freed once every such thread has been
+// seen outside a critical section or inside a later epoch, which takes
+// two advances of the global epoch.
+#define EPOCH_MAX_THREADS 8192
+// How often the reclaimer tries to advance the epoch
+#define EPOCH_RECLAIM_MS 100
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void (*destroy)(void *), void *ptr);
+
+#endif // EPOCH_H
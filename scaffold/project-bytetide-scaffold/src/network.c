@@ -1,137 +1,1631 @@
 // src/network.c
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <poll.h>
 #include <stdint.h>
+#include <time.h>
+#include "config.h"
 #include "network.h"
 #include "package.h"
 #include "peer.h"
+#include "download.h"
+#include "superseed.h"
+#include "connector.h"
+#include "diskio.h"
+#include "chunkcache.h"
 
-void send_packet(int socket, const struct btide_packet *packet) {
-    if (send(socket, packet, sizeof(struct btide_packet), 0) <= 0) {
+uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+void wire_put_u16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v & 0xff);
+    p[1] = (uint8_t)(v >> 8);
+}
+
+void wire_put_u32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v & 0xff);
+    p[1] = (uint8_t)((v >> 8) & 0xff);
+    p[2] = (uint8_t)((v >> 16) & 0xff);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+uint16_t wire_get_u16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+uint32_t wire_get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Keeps writing until the whole buffer is on the socket
+static int send_all(int socket, const uint8_t *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(socket, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Keeps reading until the whole buffer is filled, fails on EOF
+static int recv_all(int socket, uint8_t *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(socket, buf, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int send_packet(int socket, const struct btide_packet *packet) {
+    if (packet->len > PAYLOAD_MAX) {
+        fprintf(stderr, "Packet payload too large\n");
+        return -1;
+    }
+
+    uint8_t buf[FRAME_HDR_LEN + PAYLOAD_MAX];
+    wire_put_u32(buf, packet->len);
+    wire_put_u16(buf + 4, packet->msg_code);
+    wire_put_u16(buf + 6, packet->error);
+    memcpy(buf + FRAME_HDR_LEN, packet->pl.data, packet->len);
+
+    if (send_all(socket, buf, FRAME_HDR_LEN + packet->len) < 0) {
         perror("Failed to send packet");
+        return -1;
     }
+    return 0;
 }
 
-void receive_packet(int socket, struct btide_packet *packet) {
-    if (recv(socket, packet, sizeof(struct btide_packet), 0) <= 0) {
-        perror("Failed to receive packet");
+int receive_packet(int socket, struct btide_packet *packet) {
+    uint8_t hdr[FRAME_HDR_LEN];
+    if (recv_all(socket, hdr, sizeof(hdr)) < 0) {
+        return -1;
+    }
+
+    packet->len = wire_get_u32(hdr);
+    packet->msg_code = wire_get_u16(hdr + 4);
+    packet->error = wire_get_u16(hdr + 6);
+    if (packet->len > PAYLOAD_MAX) {
+        fprintf(stderr, "Oversized frame (%u bytes), dropping connection\n", packet->len);
+        return -1;
+    }
+
+    if (recv_all(socket, packet->pl.data, packet->len) < 0) {
+        return -1;
     }
+    return 0;
 }
 
-void send_req_packet(int socket, const struct req_packet *packet) {
-    send_packet(socket, (struct btide_packet *)packet);
+// Writes the identifier as u16 length + bytes, returns bytes used
+static size_t ident_length(const char *identifier) {
+    const char *end = memchr(identifier, '\0', IDENT_MAX - 1);
+    return end ? (size_t)(end - identifier) : IDENT_MAX - 1;
 }
 
-void handle_req_packet(int client_socket, const struct req_packet *packet) {
-   
-    Package *pkg = find_package_by_identifier(packet->identifier);
-    if (!pkg) {
-        fprintf(stderr, "Package not found\n");
+static size_t put_ident(uint8_t *p, const char *identifier) {
+    size_t len = ident_length(identifier);
+    wire_put_u16(p, (uint16_t)len);
+    memcpy(p + 2, identifier, len);
+    return 2 + len;
+}
+
+static int get_ident(const uint8_t *p, size_t avail, char identifier[IDENT_MAX], size_t *used) {
+    uint16_t len = wire_get_u16(p);
+    if (len >= IDENT_MAX || (size_t)len + 2 > avail) {
+        return -1;
+    }
+    memcpy(identifier, p + 2, len);
+    identifier[len] = '\0';
+    *used = 2 + (size_t)len;
+    return 0;
+}
+
+void encode_bnd_packet(uint16_t handle, const char *identifier, struct btide_packet *packet) {
+    packet->msg_code = PKT_MSG_BND;
+    packet->error = PKT_ERR_NONE;
+    wire_put_u16(packet->pl.data, handle);
+    packet->len = (uint32_t)(2 + put_ident(packet->pl.data + 2, identifier));
+}
+
+// The remote binds one of its handles to a package we manage. Later
+// REQs for the handle are served straight out of rx_handles.
+void handle_bnd_packet(Peer *peer, const struct btide_packet *packet) {
+    char identifier[IDENT_MAX];
+    size_t used;
+    if (packet->len < 4 || get_ident(packet->pl.data + 2, packet->len - 2, identifier, &used) < 0) {
+        fprintf(stderr, "Malformed BND packet\n");
         return;
     }
 
-    Chunk *chunk = find_chunk_by_hash(pkg, packet->chunk_hash);
-    if (!chunk) {
-        fprintf(stderr, "Chunk not found\n");
+    uint16_t handle = wire_get_u16(packet->pl.data);
+    struct btide_packet bna = { PKT_MSG_BNA, PKT_ERR_NONE, 2, {{0}} };
+    wire_put_u16(bna.pl.data, handle);
+
+    Package *pkg = acquire_package_by_identifier(identifier);
+    if (handle >= PEER_MAX_HANDLES) {
+        bna.error = PKT_ERR_BAD_HANDLE;
+    } else if (!pkg) {
+        bna.error = PKT_ERR_NO_PACKAGE;
+    } else {
+        // A package being removed must not be bound again behind
+        // peer_forget_package's back
+        pthread_mutex_lock(&peer->state_lock);
+        if (package_is_removed(pkg)) {
+            bna.error = PKT_ERR_NO_PACKAGE;
+        } else {
+            if (peer->rx_handles[handle] != pkg) {
+                free(peer->rx_have[handle]);
+                peer->rx_have[handle] = NULL;
+            }
+            peer->rx_handles[handle] = pkg;
+        }
+        pthread_mutex_unlock(&peer->state_lock);
+    }
+    if (peer_send(peer, &bna) == 0 && bna.error == PKT_ERR_NONE) {
+        send_bitfield(peer, handle, HANDLE_RECEIVER, pkg);
+        superseed_peer_changed(pkg);
+    }
+    if (pkg) {
+        release_package(pkg);
+    }
+}
+
+// LEB128, as used for BFD run lengths. Returns bytes written, or 0 if
+// the value does not fit in avail.
+static size_t put_varint(uint8_t *p, size_t avail, uint32_t v) {
+    size_t n = 0;
+    do {
+        if (n >= avail) {
+            return 0;
+        }
+        uint8_t byte = v & 0x7f;
+        v >>= 7;
+        p[n++] = byte | (v ? 0x80 : 0);
+    } while (v);
+    return n;
+}
+
+static int get_varint(const uint8_t *p, size_t avail, uint32_t *v, size_t *used) {
+    uint32_t value = 0;
+    for (size_t n = 0; n < avail && n < 5; n++) {
+        value |= (uint32_t)(p[n] & 0x7f) << (7 * n);
+        if (!(p[n] & 0x80)) {
+            *v = value;
+            *used = n + 1;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Encodes our completion bitmap from chunk `first` into one BFD frame,
+// as whichever of a raw bitmap or run lengths covers more chunks.
+// Returns the number of chunks the frame covers.
+static uint32_t encode_bfd_frame(Package *pkg, uint16_t handle, int scope, uint32_t first, struct btide_packet *packet) {
+    uint8_t *body = packet->pl.data + BFD_HDR_LEN;
+    size_t cap = PAYLOAD_MAX - BFD_HDR_LEN;
+    uint32_t remaining = pkg->nchunks - first;
+
+    // Runs go straight into the frame and are overwritten if raw wins
+    size_t rle_len = 1;
+    uint32_t rle_bits = 0;
+    int bit = chunk_is_complete(pkg, first);
+    body[0] = (uint8_t)bit;
+    while (rle_bits < remaining) {
+        uint32_t run = 0;
+        while (rle_bits + run < remaining && chunk_is_complete(pkg, first + rle_bits + run) == bit) {
+            run++;
+        }
+        size_t n = put_varint(body + rle_len, cap - rle_len, run);
+        if (n == 0) {
+            break;
+        }
+        rle_len += n;
+        rle_bits += run;
+        bit = !bit;
+    }
+
+    uint32_t raw_bits = remaining < cap * 8 ? remaining : (uint32_t)(cap * 8);
+    uint8_t encoding = BFD_ENC_RLE;
+    size_t body_len = rle_len;
+    if (raw_bits > rle_bits) {
+        encoding = BFD_ENC_RAW;
+        body_len = (raw_bits + 7) / 8;
+        memset(body, 0, body_len);
+        for (uint32_t i = 0; i < raw_bits; i++) {
+            if (chunk_is_complete(pkg, first + i)) {
+                body[i / 8] |= (uint8_t)(1 << (i % 8));
+            }
+        }
+    }
+
+    uint32_t covered = encoding == BFD_ENC_RAW ? raw_bits : rle_bits;
+    packet->msg_code = PKT_MSG_BFD;
+    packet->error = PKT_ERR_NONE;
+    wire_put_u16(packet->pl.data, handle);
+    packet->pl.data[2] = (uint8_t)scope;
+    packet->pl.data[3] = encoding;
+    wire_put_u32(packet->pl.data + 4, first);
+    wire_put_u32(packet->pl.data + 8, covered);
+    packet->len = (uint32_t)(BFD_HDR_LEN + body_len);
+    return covered;
+}
+
+// Summarises the whole package as its minimum completed Merkle nodes.
+// Returns -1 if there is no tree or the set does not fit in one frame.
+static int encode_bfd_nodes(Package *pkg, uint16_t handle, int scope, struct btide_packet *packet) {
+    uint32_t nodes[BFD_MAX_NODES];
+    int count = min_completed_nodes(pkg, nodes, BFD_MAX_NODES);
+    if (count < 0) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        hex_to_digest(merkle_node_hash(pkg, nodes[i]), packet->pl.data + BFD_HDR_LEN + i * DIGEST_LEN);
+    }
+    packet->msg_code = PKT_MSG_BFD;
+    packet->error = PKT_ERR_NONE;
+    wire_put_u16(packet->pl.data, handle);
+    packet->pl.data[2] = (uint8_t)scope;
+    packet->pl.data[3] = BFD_ENC_NODES;
+    wire_put_u32(packet->pl.data + 4, 0);
+    wire_put_u32(packet->pl.data + 8, pkg->nchunks);
+    packet->len = (uint32_t)(BFD_HDR_LEN + count * DIGEST_LEN);
+    return 0;
+}
+
+// One RLE frame claiming none of the package
+static void encode_bfd_empty(Package *pkg, uint16_t handle, int scope, struct btide_packet *packet) {
+    uint8_t *body = packet->pl.data + BFD_HDR_LEN;
+    body[0] = 0;
+    size_t body_len = 1 + put_varint(body + 1, PAYLOAD_MAX - BFD_HDR_LEN - 1, pkg->nchunks);
+    packet->msg_code = PKT_MSG_BFD;
+    packet->error = PKT_ERR_NONE;
+    wire_put_u16(packet->pl.data, handle);
+    packet->pl.data[2] = (uint8_t)scope;
+    packet->pl.data[3] = BFD_ENC_RLE;
+    wire_put_u32(packet->pl.data + 4, 0);
+    wire_put_u32(packet->pl.data + 8, pkg->nchunks);
+    packet->len = (uint32_t)(BFD_HDR_LEN + body_len);
+}
+
+// Advertises everything we hold of pkg, preferring the Merkle summary
+// and falling back to as many bitfield frames as it takes. While super
+// seeding we claim nothing and offer chunks with HAV instead.
+void send_bitfield(Peer *peer, uint16_t handle, int scope, Package *pkg) {
+    struct btide_packet packet;
+    if (__atomic_load_n(&pkg->superseeding, __ATOMIC_ACQUIRE)) {
+        encode_bfd_empty(pkg, handle, scope, &packet);
+        peer_send(peer, &packet);
+        return;
+    }
+    if (encode_bfd_nodes(pkg, handle, scope, &packet) == 0) {
+        peer_send(peer, &packet);
+        return;
+    }
+    uint32_t first = 0;
+    while (first < pkg->nchunks) {
+        first += encode_bfd_frame(pkg, handle, scope, first, &packet);
+        if (peer_send(peer, &packet) < 0) {
+            return;
+        }
+    }
+}
+
+// Scope is from the sender's point of view: a handle it bound is one
+// of our rx handles, a handle we bound is one of our tx handles. The
+// package comes back with a reference taken.
+static Package* availability_package(Peer *peer, uint16_t handle, int scope) {
+    return peer_acquire_package(peer, handle, scope == HANDLE_RECEIVER);
+}
+
+// Marks the chunks under each advertised node, after clearing the
+// range the frame covers. Caller holds state_lock.
+static int apply_bfd_nodes(Package *pkg, uint8_t *map, uint32_t first, uint32_t nbits, const uint8_t *body, size_t body_len) {
+    if (body_len % DIGEST_LEN != 0) {
+        return -1;
+    }
+    for (uint32_t c = first; c < first + nbits; c++) {
+        map[c / 8] &= (uint8_t)~(1 << (c % 8));
+    }
+    // Nodes arrive in chunk order, each after the one before
+    uint32_t cursor = first;
+    for (size_t off = 0; off < body_len; off += DIGEST_LEN) {
+        char hex[DIGEST_LEN * 2 + 1];
+        digest_to_hex(body + off, hex);
+        int node = find_merkle_node_from(pkg, hex, cursor);
+        if (node < 0) {
+            return -1;
+        }
+        uint32_t start, count;
+        merkle_chunk_range(pkg, (uint32_t)node, &start, &count);
+        if (start + count > first + nbits) {
+            return -1;
+        }
+        for (uint32_t c = start; c < start + count; c++) {
+            map[c / 8] |= (uint8_t)(1 << (c % 8));
+        }
+        cursor = start + count;
+    }
+    return 0;
+}
+
+void handle_bfd_packet(Peer *peer, const struct btide_packet *packet) {
+    if (packet->len < BFD_HDR_LEN) {
+        fprintf(stderr, "Malformed BFD packet\n");
+        return;
+    }
+    uint16_t handle = wire_get_u16(packet->pl.data);
+    int scope = packet->pl.data[2];
+    uint8_t encoding = packet->pl.data[3];
+    uint32_t first = wire_get_u32(packet->pl.data + 4);
+    uint32_t nbits = wire_get_u32(packet->pl.data + 8);
+    const uint8_t *body = packet->pl.data + BFD_HDR_LEN;
+    size_t body_len = packet->len - BFD_HDR_LEN;
+
+    Package *pkg = availability_package(peer, handle, scope);
+    if (!pkg || first > pkg->nchunks || nbits > pkg->nchunks - first) {
+        fprintf(stderr, "BFD packet for unknown package handle %u\n", handle);
+        if (pkg) {
+            release_package(pkg);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&peer->state_lock);
+    uint8_t *map = peer_have_map(peer, handle, scope == HANDLE_RECEIVER);
+    int ok = map != NULL;
+    if (ok && encoding == BFD_ENC_RAW) {
+        ok = body_len >= (nbits + 7) / 8;
+        for (uint32_t i = 0; ok && i < nbits; i++) {
+            uint32_t c = first + i;
+            map[c / 8] &= (uint8_t)~(1 << (c % 8));
+            map[c / 8] |= (uint8_t)(((body[i / 8] >> (i % 8)) & 1) << (c % 8));
+        }
+    } else if (ok && encoding == BFD_ENC_NODES) {
+        ok = apply_bfd_nodes(pkg, map, first, nbits, body, body_len) == 0;
+    } else if (ok && encoding == BFD_ENC_RLE && body_len > 0) {
+        int bit = body[0] & 1;
+        size_t pos = 1;
+        uint32_t done = 0;
+        while (ok && done < nbits) {
+            uint32_t run;
+            size_t used;
+            if (get_varint(body + pos, body_len - pos, &run, &used) < 0 || run > nbits - done) {
+                ok = 0;
+                break;
+            }
+            pos += used;
+            for (uint32_t c = first + done; c < first + done + run; c++) {
+                if (bit) {
+                    map[c / 8] |= (uint8_t)(1 << (c % 8));
+                } else {
+                    map[c / 8] &= (uint8_t)~(1 << (c % 8));
+                }
+            }
+            done += run;
+            bit = !bit;
+        }
+    } else {
+        ok = 0;
+    }
+    pthread_mutex_unlock(&peer->state_lock);
+
+    if (ok) {
+        download_peer_bitfield(peer, pkg);
+        superseed_peer_changed(pkg);
+    } else {
+        fprintf(stderr, "Malformed BFD packet\n");
+    }
+    release_package(pkg);
+}
+
+void handle_hav_packet(Peer *peer, const struct btide_packet *packet) {
+    if (packet->len != HAV_LEN) {
+        fprintf(stderr, "Malformed HAV packet\n");
+        return;
+    }
+    uint16_t handle = wire_get_u16(packet->pl.data);
+    int scope = packet->pl.data[2];
+    uint32_t index = wire_get_u32(packet->pl.data + 4);
+    Package *pkg = availability_package(peer, handle, scope);
+    if (!pkg || index >= pkg->nchunks) {
+        fprintf(stderr, "HAV packet for unknown package handle %u\n", handle);
+        if (pkg) {
+            release_package(pkg);
+        }
         return;
     }
 
- 
-    FILE *file = fopen(pkg->filename, "rb");
-    if (!file) {
-        perror("Failed to open file");
+    pthread_mutex_lock(&peer->state_lock);
+    uint8_t *map = peer_have_map(peer, handle, scope == HANDLE_RECEIVER);
+    if (map) {
+        map[index / 8] |= (uint8_t)(1 << (index % 8));
+    }
+    pthread_mutex_unlock(&peer->state_lock);
+    download_peer_have(peer, pkg, index);
+    superseed_peer_changed(pkg);
+    release_package(pkg);
+}
+
+// Tells the peer we hold chunk `index`, under whichever handle names
+// pkg on the connection. The HAV is posted, so this never blocks.
+// Returns -1 if neither side has bound it or the frame was dropped.
+int send_have(Peer *peer, Package *pkg, uint32_t index) {
+    int ours;
+    int handle = peer_handle_for(peer, pkg, &ours);
+    if (handle < 0) {
+        return -1;
+    }
+    struct btide_packet hav = { PKT_MSG_HAV, PKT_ERR_NONE, HAV_LEN, {{0}} };
+    wire_put_u16(hav.pl.data, (uint16_t)handle);
+    hav.pl.data[2] = ours ? HANDLE_SENDER : HANDLE_RECEIVER;
+    wire_put_u32(hav.pl.data + 4, index);
+    return peer_post(peer, &hav);
+}
+
+// Tells every peer that has pkg bound that we now hold chunk `index`
+void broadcast_have(Package *pkg, uint32_t index) {
+    Peer *snapshot[PEER_TABLE_MAX];
+    int count = snapshot_peers(snapshot, PEER_TABLE_MAX);
+
+    for (int i = 0; i < count; i++) {
+        send_have(snapshot[i], pkg, index);
+        release_peer(snapshot[i]);
+    }
+}
+
+void handle_bna_packet(Peer *peer, const struct btide_packet *packet) {
+    if (packet->len < 2) {
+        fprintf(stderr, "Malformed BNA packet\n");
+        return;
+    }
+    if (packet->error == PKT_ERR_NONE) {
         return;
     }
+    Package *pkg = peer_acquire_package(peer, wire_get_u16(packet->pl.data), 1);
+    if (pkg) {
+        printf("Peer %s:%d does not manage package %s\n", peer->ip, peer->port, pkg->ident);
+        release_package(pkg);
+    }
+}
 
-    fseek(file, packet->file_offset, SEEK_SET);
-    char data[packet->data_len];
-    fread(data, 1, packet->data_len, file);
-    fclose(file);
+int encode_req_packet(const struct req_packet *req, struct btide_packet *packet) {
+    uint8_t *p = packet->pl.data;
+    packet->msg_code = PKT_MSG_REQ;
+    packet->error = req->error;
+    wire_put_u16(p, req->handle);
+    wire_put_u32(p + 2, req->chunk_index);
+    wire_put_u32(p + 6, req->file_offset);
+    wire_put_u32(p + 10, req->data_len);
+    packet->len = REQ_HDR_LEN;
+    return 0;
+}
+
+int decode_req_packet(const struct btide_packet *packet, struct req_packet *req) {
+    const uint8_t *p = packet->pl.data;
+    if (packet->len != REQ_HDR_LEN) {
+        return -1;
+    }
+    req->msg_code = packet->msg_code;
+    req->error = packet->error;
+    req->handle = wire_get_u16(p);
+    req->chunk_index = wire_get_u32(p + 2);
+    req->file_offset = wire_get_u32(p + 6);
+    req->data_len = wire_get_u32(p + 10);
+    return 0;
+}
+
+int encode_brq_packet(const struct brq_packet *brq, struct btide_packet *packet) {
+    uint8_t *p = packet->pl.data;
+    if (brq->nranges > BRQ_MAX_RANGES) {
+        return -1;
+    }
+    packet->msg_code = PKT_MSG_BRQ;
+    packet->error = PKT_ERR_NONE;
+    wire_put_u16(p, brq->handle);
+    wire_put_u16(p + 2, brq->nranges);
+    for (uint16_t i = 0; i < brq->nranges; i++) {
+        wire_put_u32(p + BRQ_HDR_LEN + i * BRQ_RANGE_LEN, brq->ranges[i].first);
+        wire_put_u32(p + BRQ_HDR_LEN + i * BRQ_RANGE_LEN + 4, brq->ranges[i].count);
+    }
+    packet->len = BRQ_HDR_LEN + brq->nranges * BRQ_RANGE_LEN;
+    return 0;
+}
+
+int decode_brq_packet(const struct btide_packet *packet, struct brq_packet *brq) {
+    const uint8_t *p = packet->pl.data;
+    if (packet->len < BRQ_HDR_LEN) {
+        return -1;
+    }
+    brq->handle = wire_get_u16(p);
+    brq->nranges = wire_get_u16(p + 2);
+    if (brq->nranges > BRQ_MAX_RANGES || packet->len != BRQ_HDR_LEN + brq->nranges * BRQ_RANGE_LEN) {
+        return -1;
+    }
+    for (uint16_t i = 0; i < brq->nranges; i++) {
+        brq->ranges[i].first = wire_get_u32(p + BRQ_HDR_LEN + i * BRQ_RANGE_LEN);
+        brq->ranges[i].count = wire_get_u32(p + BRQ_HDR_LEN + i * BRQ_RANGE_LEN + 4);
+    }
+    return 0;
+}
+
+int encode_res_packet(const struct res_packet *res, struct btide_packet *packet) {
+    uint8_t *p = packet->pl.data;
+    if (res->data_len > RES_DATA_MAX) {
+        return -1;
+    }
+    packet->msg_code = PKT_MSG_RES;
+    packet->error = res->error;
+    wire_put_u16(p, res->handle);
+    wire_put_u32(p + 2, res->chunk_index);
+    wire_put_u32(p + 6, res->file_offset);
+    wire_put_u32(p + 10, res->data_len);
+    memcpy(p + RES_HDR_LEN, res->data, res->data_len);
+    packet->len = RES_HDR_LEN + res->data_len;
+    return 0;
+}
+
+int decode_res_packet(const struct btide_packet *packet, struct res_packet *res) {
+    const uint8_t *p = packet->pl.data;
+    if (packet->len < RES_HDR_LEN) {
+        return -1;
+    }
+    res->msg_code = packet->msg_code;
+    res->error = packet->error;
+    res->handle = wire_get_u16(p);
+    res->chunk_index = wire_get_u32(p + 2);
+    res->file_offset = wire_get_u32(p + 6);
+    res->data_len = wire_get_u32(p + 10);
+    if (res->data_len > RES_DATA_MAX || RES_HDR_LEN + res->data_len != packet->len) {
+        return -1;
+    }
+    memcpy(res->data, p + RES_HDR_LEN, res->data_len);
+    return 0;
+}
+
+int send_req_packet(Peer *peer, const struct req_packet *packet) {
+    struct btide_packet frame;
+    encode_req_packet(packet, &frame);
+    return peer_send(peer, &frame);
+}
 
-   
+static void send_res_error(Peer *peer, uint16_t handle, uint32_t chunk_index, uint32_t offset, uint16_t error) {
     struct res_packet res;
-    res.file_offset = packet->file_offset;
-    res.data_len = packet->data_len;
-    memcpy(res.data, data, packet->data_len);
-    strncpy(res.chunk_hash, packet->chunk_hash, 64);
-    strncpy(res.identifier, packet->identifier, 1024);
-    
-    send_packet(client_socket, (struct btide_packet *)&res);
+    res.msg_code = PKT_MSG_RES;
+    res.error = error;
+    res.handle = handle;
+    res.chunk_index = chunk_index;
+    res.file_offset = offset;
+    res.data_len = 0;
+    send_res_packet(peer, &res);
+}
+
+// Every chunk data frame passes the node, peer and package buckets
+static void limit_upload(Peer *peer, Package *pkg, uint32_t bytes) {
+    bucket_consume(&pkg->upload_limit, bytes);
+    bucket_consume(&peer->upload_limit, bytes);
+    bucket_consume(&upload_limit, bytes);
+}
+
+// Charges received data to the limiters without waiting, so the reader
+// keeps handling pings and control frames. The credit the data used is
+// held back until the limiters have let it through.
+static void limit_download(Peer *peer, Package *pkg, uint32_t bytes) {
+    uint64_t wait_ns = bucket_charge(&pkg->download_limit, bytes);
+    uint64_t ns = bucket_charge(&peer->download_limit, bytes);
+    wait_ns = ns > wait_ns ? ns : wait_ns;
+    ns = bucket_charge(&download_limit, bytes);
+    wait_ns = ns > wait_ns ? ns : wait_ns;
+    if (wait_ns) {
+        uint64_t due = monotonic_ms() + (wait_ns + 999999) / 1000000;
+        if (due > peer->credit_due_ms) {
+            peer->credit_due_ms = due;
+        }
+    }
+}
+
+// Fragments len bytes starting at file offset `offset` into RES frames.
+// Each data frame spends one unit of the receiver's window. Returns 1
+// if the remote withdrew the chunk part way, -1 once the connection is
+// closing.
+static int send_chunk_data(Peer *peer, Package *pkg, uint16_t handle, uint32_t index, uint32_t offset, const char *data, uint32_t len) {
+    struct res_packet res;
+    res.msg_code = PKT_MSG_RES;
+    res.error = PKT_ERR_NONE;
+    res.handle = handle;
+    res.chunk_index = index;
+    for (uint32_t done = 0; done < len; done += res.data_len) {
+        res.file_offset = offset + done;
+        res.data_len = len - done;
+        if (res.data_len > RES_DATA_MAX) {
+            res.data_len = RES_DATA_MAX;
+        }
+        memcpy(res.data, data + done, res.data_len);
+        if (peer_upload_cancelled(peer)) {
+            return 1;
+        }
+        if (peer_take_credit(peer) < 0) {
+            return -1;
+        }
+        limit_upload(peer, pkg, res.data_len);
+        if (send_res_packet(peer, &res) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Streams [offset, offset + len) of one chunk, reading the file in
+// blocks so a multi-MB chunk never has to sit in memory whole
+static int serve_chunk_part(Peer *peer, Package *pkg, uint16_t handle, uint32_t index, uint32_t offset, uint32_t len) {
+    uint32_t block = len < STREAM_BLOCK_BYTES ? len : STREAM_BLOCK_BYTES;
+    char *buf = malloc(block ? block : 1);
+    if (!buf) {
+        fprintf(stderr, "Failed to allocate stream buffer\n");
+        return -1;
+    }
+
+    int rc = 0;
+    for (uint32_t done = 0; done < len && rc == 0; done += block) {
+        uint32_t n = len - done < block ? len - done : block;
+        struct iovec iov = { buf, n };
+        if (disk_preadv(pkg, index, &iov, 1, offset + done) != (ssize_t)n) {
+            perror("Failed to read chunk");
+            send_res_error(peer, handle, index, offset + done, PKT_ERR_NO_CHUNK);
+            break;
+        }
+        rc = send_chunk_data(peer, pkg, handle, index, offset + done, buf, n);
+    }
+    free(buf);
+    return rc;
+}
+
+// Serves part of one chunk for a REQ. Unless it is too big for a batch,
+// the whole chunk is read, once however many peers want it at the same
+// time, and offered to the cache.
+static int serve_chunk_slice(Peer *peer, Package *pkg, uint16_t handle, uint32_t index, uint32_t offset, uint32_t len) {
+    const Chunk *chunk = &pkg->chunks[index];
+    CacheEntry *hit;
+    if (cache_acquire(pkg, index, 1, &hit) == CACHE_MISS) {
+        return serve_chunk_part(peer, pkg, handle, index, offset, len);
+    }
+
+    const char *data;
+    char *buf = NULL;
+    if (hit) {
+        data = hit->data;
+    } else {
+        buf = malloc(chunk->size ? chunk->size : 1);
+        struct iovec iov = { buf, chunk->size };
+        if (!buf || disk_preadv(pkg, index, &iov, 1, chunk->offset) != (ssize_t)chunk->size) {
+            fprintf(stderr, "Failed to read chunk\n");
+            cache_fill(pkg, index, NULL);
+            free(buf);
+            send_res_error(peer, handle, index, offset, PKT_ERR_NO_CHUNK);
+            return 0;
+        }
+        cache_fill(pkg, index, buf);
+        data = buf;
+    }
+    // handle_req_packet already kept the slice inside the chunk
+    int rc = send_chunk_data(peer, pkg, handle, index, offset, data + (offset - chunk->offset), len);
+    if (hit) {
+        cache_release(hit);
+    }
+    free(buf);
+    return rc;
+}
+
+// Number of chunks from first (bounded by end) that sit back to back
+// in the file and fit inside one batch read, each claimed for reading.
+// The run stops before a chunk another read has in flight, and before a
+// cached one, which is handed back in hit for the caller to serve.
+static uint32_t batch_run_length(const Package *pkg, uint32_t first, uint32_t end, CacheEntry **hit) {
+    uint32_t run = 1;
+    uint32_t bytes = pkg->chunks[first].size;
+    while (first + run < end && run < BATCH_MAX_CHUNKS) {
+        const Chunk *prev = &pkg->chunks[first + run - 1];
+        const Chunk *next = &pkg->chunks[first + run];
+        if (next->offset != prev->offset + prev->size || bytes + next->size > BATCH_MAX_BYTES
+            || !chunk_is_complete(pkg, first + run)) {
+            break;
+        }
+        // Never wait on another read while holding claims of our own
+        if (cache_acquire(pkg, first + run, 0, hit) != CACHE_CLAIMED) {
+            break;
+        }
+        bytes += next->size;
+        run++;
+    }
+    return run;
+}
+
+// Reads a run of claimed adjacent chunks with one preadv, settles the
+// claims so waiting peers are served too, then streams them out
+static int serve_chunk_run(Peer *peer, Package *pkg, uint16_t handle, uint32_t first, uint32_t run) {
+    struct iovec iov[BATCH_MAX_CHUNKS];
+    size_t total = 0;
+    for (uint32_t i = 0; i < run; i++) {
+        total += pkg->chunks[first + i].size;
+    }
+
+    char *buf = malloc(total ? total : 1);
+    ssize_t n = -1;
+    if (buf) {
+        size_t pos = 0;
+        for (uint32_t i = 0; i < run; i++) {
+            iov[i].iov_base = buf + pos;
+            iov[i].iov_len = pkg->chunks[first + i].size;
+            pos += iov[i].iov_len;
+        }
+        n = disk_preadv(pkg, first, iov, (int)run, pkg->chunks[first].offset);
+    }
+    int ok = n >= 0 && (size_t)n == total;
+    for (uint32_t i = 0; i < run; i++) {
+        cache_fill(pkg, first + i, ok ? iov[i].iov_base : NULL);
+    }
+    if (!ok) {
+        fprintf(stderr, "Failed to read chunk batch\n");
+        free(buf);
+        send_res_error(peer, handle, first, pkg->chunks[first].offset, PKT_ERR_NO_CHUNK);
+        return 0;
+    }
+
+    int rc = 0;
+    for (uint32_t i = 0; i < run && rc == 0; i++) {
+        Chunk *chunk = &pkg->chunks[first + i];
+        rc = send_chunk_data(peer, pkg, handle, first + i, chunk->offset, iov[i].iov_base, chunk->size);
+    }
+    free(buf);
+    return rc;
+}
+
+static int serve_chunk_range(Peer *peer, Package *pkg, uint16_t handle, uint32_t first, uint32_t count) {
+    uint32_t end = first + count;
+    // A cached chunk found while sizing the last batch
+    CacheEntry *hit = NULL;
+    int rc = 0;
+    while (first < end && rc == 0) {
+        Chunk *chunk = &pkg->chunks[first];
+        // Only verified data is ever served
+        if (!chunk_is_complete(pkg, first)) {
+            send_res_error(peer, handle, first, chunk->offset, PKT_ERR_NO_CHUNK);
+            first++;
+            continue;
+        }
+        int found = CACHE_HIT;
+        if (!hit) {
+            found = cache_acquire(pkg, first, 1, &hit);
+        }
+        if (hit) {
+            rc = send_chunk_data(peer, pkg, handle, first, chunk->offset, hit->data, hit->size);
+            cache_release(hit);
+            hit = NULL;
+            first++;
+        } else if (found == CACHE_MISS) {
+            rc = serve_chunk_part(peer, pkg, handle, first, chunk->offset, chunk->size);
+            first++;
+        } else {
+            uint32_t run = batch_run_length(pkg, first, end, &hit);
+            rc = serve_chunk_run(peer, pkg, handle, first, run);
+            first += run;
+        }
+    }
+    if (hit) {
+        cache_release(hit);
+    }
+    return rc;
+}
+
+// Serving blocks on the receiver's window, and window updates arrive on
+// the reader thread, so requests are queued here rather than served
+// inline by handle_client
+void* upload_worker(void* arg) {
+    Peer *peer = (Peer*)arg;
+    UploadJob *job;
+    while ((job = peer_next_upload(peer)) != NULL) {
+        int rc;
+        if (job->len && !chunk_is_complete(job->pkg, job->first)) {
+            send_res_error(peer, job->handle, job->first, job->offset, PKT_ERR_NO_CHUNK);
+            rc = 0;
+        } else if (job->len) {
+            rc = serve_chunk_slice(peer, job->pkg, job->handle, job->first, job->offset, job->len);
+        } else {
+            rc = serve_chunk_range(peer, job->pkg, job->handle, job->first, job->count);
+        }
+        peer_finish_upload(peer, job);
+        if (rc < 0) {
+            break;
+        }
+    }
+    release_peer(peer);
+    return NULL;
+}
+
+static void send_notice(Peer *peer, uint16_t msg_code) {
+    struct btide_packet notice = { msg_code, PKT_ERR_NONE, 0, {{0}} };
+    peer_send(peer, &notice);
+}
+
+// Requests are only served while the peer holds an upload slot; a
+// refused one is dropped and the peer told it is choked
+static void queue_if_unchoked(Peer *peer, const UploadJob *job) {
+    uint16_t notify;
+    int granted = peer_request_slot(peer, config.upload_slots, &notify);
+    if (notify) {
+        send_notice(peer, notify);
+    }
+    if (granted) {
+        peer_queue_upload(peer, job);
+    }
+}
+
+// A choked peer still wants data, which may earn it a free slot now
+void handle_int_packet(Peer *peer) {
+    uint16_t notify;
+    peer_request_slot(peer, config.upload_slots, &notify);
+    if (notify) {
+        send_notice(peer, notify);
+    }
+}
+
+static void queue_chunk_request(Peer *peer, Package *pkg, const struct req_packet *packet) {
+    if (packet->chunk_index >= pkg->nchunks) {
+        send_res_error(peer, packet->handle, packet->chunk_index, packet->file_offset, PKT_ERR_NO_CHUNK);
+        return;
+    }
+    Chunk *chunk = &pkg->chunks[packet->chunk_index];
+
+    // Serve the requested span, or the rest of the chunk, never past its end
+    uint32_t offset = packet->file_offset;
+    if (offset < chunk->offset || offset >= chunk->offset + chunk->size) {
+        send_res_error(peer, packet->handle, packet->chunk_index, packet->file_offset, PKT_ERR_NO_CHUNK);
+        return;
+    }
+    uint32_t len = packet->data_len;
+    if (len == 0 || len > chunk->offset + chunk->size - offset) {
+        len = chunk->offset + chunk->size - offset;
+    }
+
+    UploadJob job = { pkg, packet->handle, packet->chunk_index, 1, offset, len, 0, NULL };
+    queue_if_unchoked(peer, &job);
+}
+
+void handle_req_packet(Peer *peer, const struct req_packet *packet) {
+    Package *pkg = peer_acquire_package(peer, packet->handle, 0);
+    if (!pkg) {
+        send_res_error(peer, packet->handle, packet->chunk_index, packet->file_offset, PKT_ERR_BAD_HANDLE);
+        return;
+    }
+    queue_chunk_request(peer, pkg, packet);
+    release_package(pkg);
+}
+
+void handle_brq_packet(Peer *peer, const struct brq_packet *packet) {
+    Package *pkg = peer_acquire_package(peer, packet->handle, 0);
+    if (!pkg) {
+        send_res_error(peer, packet->handle, packet->nranges ? packet->ranges[0].first : 0, 0, PKT_ERR_BAD_HANDLE);
+        return;
+    }
+
+    for (uint16_t r = 0; r < packet->nranges; r++) {
+        uint32_t first = packet->ranges[r].first;
+        uint32_t count = packet->ranges[r].count;
+        if (first >= pkg->nchunks || count > pkg->nchunks - first) {
+            send_res_error(peer, packet->handle, first, 0, PKT_ERR_NO_CHUNK);
+            continue;
+        }
+        UploadJob job = { pkg, packet->handle, first, count, pkg->chunks[first].offset, 0, 0, NULL };
+        queue_if_unchoked(peer, &job);
+    }
+    release_package(pkg);
 }
 
+// The remote wants everything under one Merkle node. The node maps to a
+// contiguous chunk range, which is served exactly like a BRQ range.
+void handle_srq_packet(Peer *peer, const struct btide_packet *packet) {
+    if (packet->len != SRQ_LEN) {
+        fprintf(stderr, "Malformed SRQ packet\n");
+        return;
+    }
+    uint16_t handle = wire_get_u16(packet->pl.data);
+    Package *pkg = peer_acquire_package(peer, handle, 0);
+    if (!pkg) {
+        send_res_error(peer, handle, 0, 0, PKT_ERR_BAD_HANDLE);
+        return;
+    }
+
+    char hex[DIGEST_LEN * 2 + 1];
+    digest_to_hex(packet->pl.data + 2, hex);
+    int node = find_merkle_node(pkg, hex);
+    if (node < 0) {
+        send_res_error(peer, handle, 0, 0, PKT_ERR_NO_NODE);
+    } else {
+        uint32_t first, count;
+        merkle_chunk_range(pkg, (uint32_t)node, &first, &count);
+        UploadJob job = { pkg, handle, first, count, pkg->chunks[first].offset, 0, 0, NULL };
+        queue_if_unchoked(peer, &job);
+    }
+    release_package(pkg);
+}
 
-void send_res_packet(int socket, const struct res_packet *packet) {
-    send_packet(socket, (struct btide_packet *)packet);
+// Posted rather than sent, as it goes out from the completion thread
+void send_can_packet(Peer *peer, uint16_t handle, uint32_t chunk_index) {
+    struct btide_packet can = { PKT_MSG_CAN, PKT_ERR_NONE, CAN_LEN, {{0}} };
+    wire_put_u16(can.pl.data, handle);
+    wire_put_u32(can.pl.data + 2, chunk_index);
+    peer_post(peer, &can);
 }
 
-void handle_res_packet(int client_socket, const struct res_packet *packet) {
-   
-    FILE *file = fopen(packet->identifier, "rb+");
-    if (!file) {
-        perror("Failed to open file");
+// The remote got the chunk elsewhere; skip it if it is still queued
+void handle_can_packet(Peer *peer, const struct btide_packet *packet) {
+    if (packet->len != CAN_LEN) {
+        fprintf(stderr, "Malformed CAN packet\n");
         return;
     }
+    uint16_t handle = wire_get_u16(packet->pl.data);
+    uint32_t index = wire_get_u32(packet->pl.data + 2);
+    Package *pkg = peer_acquire_package(peer, handle, 0);
+    if (pkg && index < pkg->nchunks) {
+        peer_cancel_upload(peer, pkg, index);
+    }
+    if (pkg) {
+        release_package(pkg);
+    }
+}
 
-    fseek(file, packet->file_offset, SEEK_SET);
-    fwrite(packet->data, 1, packet->data_len, file);
-    fclose(file);
+void handle_wnd_packet(Peer *peer, const struct btide_packet *packet) {
+    if (packet->len != 4) {
+        fprintf(stderr, "Malformed WND packet\n");
+        return;
+    }
+    peer_grant_credit(peer, (int)wire_get_u32(packet->pl.data));
+}
 
-    printf("Received data for chunk %s\n", packet->chunk_hash);
+// Hands window back to the sender once half of it has been consumed
+// and the download limiters allow
+static void grant_window(Peer *peer) {
+    if (peer->recv_unacked < PEER_FRAG_WINDOW / 2 || monotonic_ms() < peer->credit_due_ms) {
+        return;
+    }
+    if (peer->disk_wait >= 0) {
+        if (disk_queue_full(peer->disk_wait)) {
+            return;
+        }
+        peer->disk_wait = -1;
+    }
+    struct btide_packet wnd = { PKT_MSG_WND, PKT_ERR_NONE, 4, {{0}} };
+    wire_put_u32(wnd.pl.data, (uint32_t)peer->recv_unacked);
+    peer->recv_unacked = 0;
+    peer_send(peer, &wnd);
+}
+
+static void consume_window(Peer *peer) {
+    peer->recv_unacked++;
+    grant_window(peer);
+}
+
+// Waits for the next frame, but no longer than withheld credit is due
+// or a full disk queue takes to look at again, so a throttled sender is
+// not left waiting on a quiet connection. Returns 1 once a frame can be
+// read.
+static int wait_for_frame(Peer *peer) {
+    grant_window(peer);
+    if (peer->recv_unacked < PEER_FRAG_WINDOW / 2) {
+        return 1;
+    }
+    uint64_t now = monotonic_ms();
+    int timeout = now < peer->credit_due_ms ? (int)(peer->credit_due_ms - now) : DISK_RECHECK_MS;
+    if (peer->disk_wait >= 0 && timeout > DISK_RECHECK_MS) {
+        timeout = DISK_RECHECK_MS;
+    }
+    struct pollfd pfd = { peer->socket, POLLIN, 0 };
+    int rc = poll(&pfd, 1, timeout);
+    return rc > 0 || (rc < 0 && errno != EINTR);
+}
+
+
+int send_res_packet(Peer *peer, const struct res_packet *packet) {
+    struct btide_packet frame;
+    if (encode_res_packet(packet, &frame) < 0) {
+        fprintf(stderr, "Response does not fit in a frame\n");
+        return -1;
+    }
+    return peer_send(peer, &frame);
+}
+
+// A received fragment of a response, written out by a disk thread. One
+// that completes a chunk is then passed to the completion thread with
+// what commit_chunk made of it.
+typedef struct {
+    DiskJob job;
+    Peer *peer;
+    uint16_t handle;
+    uint32_t offset;
+    uint32_t len;
+    // Set when the fragment completed a chunk hashed as it streamed in
+    int hashed;
+    uint8_t digest[DIGEST_LEN];
+    int committed;
+    char data[];
+} ChunkWrite;
+
+static void drop_chunk_write(DiskJob *job) {
+    ChunkWrite *write = (ChunkWrite *)job;
+    release_peer(write->peer);
+    free(write);
+}
+
+// Tells the peers and the download how committing a chunk went, and
+// asks for it again if it did not verify. Runs on the completion
+// thread, which only posts frames, so one stalled peer holds up no one.
+static void run_chunk_done(DiskJob *job) {
+    ChunkWrite *write = (ChunkWrite *)job;
+    Peer *peer = write->peer;
+    Package *pkg = job->pkg;
+    uint16_t handle = write->handle;
+    uint32_t index = job->chunk_index;
+    Chunk *chunk = &pkg->chunks[index];
+    int committed = write->committed;
+    if (committed < 0) {
+        printf("Received chunk %s does not match its hash, discarding\n", chunk->hash);
+        // A managed download asks another peer; a manual fetch retries here
+        if (!download_chunk_failed(peer, pkg, index) && chunk->failures < CHUNK_MAX_FAILURES) {
+            struct req_packet req = { PKT_MSG_REQ, PKT_ERR_NONE, handle, index, chunk->offset, 0 };
+            struct btide_packet frame;
+            encode_req_packet(&req, &frame);
+            peer_post(peer, &frame);
+        }
+        drop_chunk_write(job);
+        return;
+    }
+    if (committed > 0) {
+        printf("Received data for chunk %s\n", chunk->hash);
+        broadcast_have(pkg, index);
+    }
+    download_chunk_done(peer, pkg, index);
+
+    uint32_t node;
+    if (peer_subtree_progress(peer, pkg, index, &node)) {
+        int ok = verify_subtree(pkg, node);
+        printf("Subtree %s %s\n", merkle_node_hash(pkg, node), ok == 1 ? "verified" : "failed verification");
+    }
+    drop_chunk_write(job);
+}
+
+// Commits a chunk whose last byte is on disk and leaves the rest to the
+// completion thread, which takes over the job
+static void finish_chunk(ChunkWrite *write, const uint8_t digest[DIGEST_LEN]) {
+    write->committed = commit_chunk(write->job.pkg, write->job.chunk_index, digest);
+    write->job.run = run_chunk_done;
+    disk_complete(&write->job);
+}
+
+static void run_chunk_write(DiskJob *job) {
+    ChunkWrite *write = (ChunkWrite *)job;
+    Package *pkg = job->pkg;
+    Chunk *chunk = &pkg->chunks[job->chunk_index];
+
+    // Another peer's copy may have been verified while this one queued
+    if (chunk_is_complete(pkg, job->chunk_index)) {
+        drop_chunk_write(job);
+        return;
+    }
+    if (pwrite(pkg->fd, write->data, write->len, write->offset) != (ssize_t)write->len) {
+        perror("Failed to write chunk data");
+        drop_chunk_write(job);
+        return;
+    }
+
+    if (write->hashed) {
+        finish_chunk(write, write->digest);
+        return;
+    }
+    if (write->offset + write->len == chunk->offset + chunk->size) {
+        // The tail of a chunk that did not stream from its first byte
+        // (a FETCH with an offset) can only be checked from disk
+        char hex[DIGEST_LEN * 2 + 1];
+        uint8_t digest[DIGEST_LEN];
+        if (hash_chunk_data(pkg, job->chunk_index, hex) == 0 && hex_to_digest(hex, digest) == 0) {
+            finish_chunk(write, digest);
+            return;
+        }
+    }
+    drop_chunk_write(job);
+}
+
+static void take_response(Peer *peer, Package *pkg, const struct res_packet *packet) {
+    Chunk *chunk = &pkg->chunks[packet->chunk_index];
+    if (packet->error == PKT_ERR_NO_NODE) {
+        printf("Peer could not find the requested subtree\n");
+        return;
+    }
+    if (packet->error != PKT_ERR_NONE) {
+        if (!download_chunk_failed(peer, pkg, packet->chunk_index)) {
+            printf("Peer could not serve chunk %s (error %u)\n", chunk->hash, packet->error);
+        }
+        return;
+    }
+    if (packet->file_offset < chunk->offset
+        || packet->file_offset + packet->data_len > chunk->offset + chunk->size) {
+        fprintf(stderr, "Response data outside of chunk\n");
+        return;
+    }
+
+    // A verified chunk is never overwritten, duplicates are dropped, and
+    // only one peer at a time writes a chunk the download asked several for
+    if (chunk_is_complete(pkg, packet->chunk_index) || !download_accept_data(peer, pkg, packet->chunk_index, packet->file_offset)) {
+        return;
+    }
+
+    // Hashing is in memory and stays on this thread; the write and the
+    // commit go to the disk threads, and what follows to the completion
+    // thread
+    ChunkWrite *write = malloc(sizeof(ChunkWrite) + packet->data_len);
+    if (!write) {
+        fprintf(stderr, "Failed to allocate chunk write\n");
+        return;
+    }
+    write->job.run = run_chunk_write;
+    write->job.drop = drop_chunk_write;
+    write->job.pkg = pkg;
+    write->job.chunk_index = packet->chunk_index;
+    write->peer = peer;
+    write->handle = packet->handle;
+    write->offset = packet->file_offset;
+    write->len = packet->data_len;
+    memcpy(write->data, packet->data, packet->data_len);
+    write->hashed = peer_receive_data(peer, pkg, packet->chunk_index, packet->file_offset, packet->data, packet->data_len, write->digest);
+    retain_peer(peer);
+    // Rather than wait for room, stop handing back credit until there is
+    int queue = disk_post(&write->job);
+    if (queue >= 0) {
+        peer->disk_wait = queue;
+    }
+}
+
+void handle_res_packet(Peer *peer, const struct res_packet *packet) {
+    Package *pkg = peer_acquire_package(peer, packet->handle, 1);
+    if (packet->error == PKT_ERR_NONE) {
+        // Credit goes back only once the limiters let the data through
+        if (pkg) {
+            limit_download(peer, pkg, packet->data_len);
+        }
+        consume_window(peer);
+    }
+
+    if (!pkg || packet->chunk_index >= pkg->nchunks) {
+        fprintf(stderr, "Response for unknown package handle %u\n", packet->handle);
+    } else {
+        take_response(peer, pkg, packet);
+    }
+    if (pkg) {
+        release_package(pkg);
+    }
 }
 
 
 void* handle_client(void* arg) {
-    int client_socket = *((int*)arg);
-    free(arg);
+    Peer *peer = (Peer*)arg;
+
+    // The upload thread holds its own reference to the peer
+    retain_peer(peer);
+    pthread_t upload_thread;
+    pthread_create(&upload_thread, NULL, upload_worker, peer);
+    pthread_detach(upload_thread);
 
     struct btide_packet packet;
+    struct req_packet req;
+    struct res_packet res;
+    struct brq_packet brq;
     while (1) {
-        receive_packet(client_socket, &packet);
+        if (!wait_for_frame(peer)) {
+            continue;
+        }
+        if (receive_packet(peer->socket, &packet) < 0) {
+            printf("Connection closed by peer %s:%d\n", peer->ip, peer->port);
+            break;
+        }
+        if (packet.msg_code == PKT_MSG_DSN) {
+            printf("Client requested disconnect\n");
+            break;
+        }
+        if (packet.msg_code == PKT_MSG_ACP) {
+            printf("Received ACP from client\n");
+            // Full, or already connected to this address and port
+            if (add_peer(peer) < 0) {
+                printf("Refusing peer %s:%d\n", peer->ip, peer->port);
+                break;
+            }
+            struct btide_packet ack_packet = { PKT_MSG_ACK, 0, 0, {{0}} };
+            if (peer_send(peer, &ack_packet) == 0) {
+                send_pex(peer);
+            }
+            continue;
+        }
+        // Handlers take their own reference to any package they use, so
+        // none of them pins the epoch while it sends
         switch (packet.msg_code) {
-            case PKT_MSG_ACP:
-                printf("Received ACP from client\n");
-                struct btide_packet ack_packet = { PKT_MSG_ACK, 0, {{0}} };
-                send_packet(client_socket, &ack_packet);
-                break;
-            case PKT_MSG_DSN:
-                printf("Client requested disconnect\n");
-                close(client_socket);
-                return NULL;
+            case PKT_MSG_PNG:
+                packet.msg_code = PKT_MSG_POG;
+                peer_send(peer, &packet);
+                break;
+            case PKT_MSG_POG:
+                handle_pog_packet(peer, &packet);
+                break;
+            case PKT_MSG_BND:
+                handle_bnd_packet(peer, &packet);
+                break;
+            case PKT_MSG_BNA:
+                handle_bna_packet(peer, &packet);
+                break;
             case PKT_MSG_REQ:
-                handle_req_packet(client_socket, (struct req_packet *)&packet);
+                if (decode_req_packet(&packet, &req) < 0) {
+                    fprintf(stderr, "Malformed REQ packet\n");
+                    break;
+                }
+                handle_req_packet(peer, &req);
+                break;
+            case PKT_MSG_BRQ:
+                if (decode_brq_packet(&packet, &brq) < 0) {
+                    fprintf(stderr, "Malformed BRQ packet\n");
+                    break;
+                }
+                handle_brq_packet(peer, &brq);
+                break;
+            case PKT_MSG_SRQ:
+                handle_srq_packet(peer, &packet);
+                break;
+            case PKT_MSG_WND:
+                handle_wnd_packet(peer, &packet);
+                break;
+            case PKT_MSG_BFD:
+                handle_bfd_packet(peer, &packet);
+                break;
+            case PKT_MSG_HAV:
+                handle_hav_packet(peer, &packet);
+                break;
+            case PKT_MSG_CAN:
+                handle_can_packet(peer, &packet);
+                break;
+            case PKT_MSG_CHK:
+                printf("Peer %s:%d is choking us\n", peer->ip, peer->port);
+                peer_set_choking_us(peer, 1);
+                download_peer_choked(peer);
+                break;
+            case PKT_MSG_UNC:
+                peer_set_choking_us(peer, 0);
+                download_peer_unchoked(peer);
+                break;
+            case PKT_MSG_PEX:
+                handle_pex_packet(peer, &packet);
+                break;
+            case PKT_MSG_INT:
+                handle_int_packet(peer);
                 break;
             case PKT_MSG_RES:
-                handle_res_packet(client_socket, (struct res_packet *)&packet);
+                if (decode_res_packet(&packet, &res) < 0) {
+                    fprintf(stderr, "Malformed RES packet\n");
+                    break;
+                }
+                handle_res_packet(peer, &res);
                 break;
             default:
                 printf("Unknown packet type: %d\n", packet.msg_code);
                 break;
         }
     }
+
+    peer_close(peer);
+    download_peer_gone(peer);
+    remove_peer(peer);
+    release_peer(peer);
+    return NULL;
+}
+
+
+void handle_pog_packet(Peer *peer, const struct btide_packet *packet) {
+    if (packet->len != PNG_LEN) {
+        fprintf(stderr, "Malformed POG packet\n");
+        return;
+    }
+    uint64_t sent = (uint64_t)wire_get_u32(packet->pl.data) | (uint64_t)wire_get_u32(packet->pl.data + 4) << 32;
+    peer_heartbeat_answered(peer, monotonic_ms() - sent);
+}
+
+// Pings every connected peer each heartbeat_interval. A peer that has
+// left heartbeat_misses pings unanswered has its socket shut down, so
+// its reader thread tears the session down and the download manager
+// takes back its requests. One stuck peer must not hold up the rest,
+// so a ping that cannot go out at once is skipped and counts as missed.
+static void* heartbeat_worker(void* arg) {
+    (void)arg;
+    while (1) {
+        sleep((unsigned int)config.heartbeat_interval);
+
+        Peer *snapshot[PEER_TABLE_MAX];
+        int count = snapshot_peers(snapshot, PEER_TABLE_MAX);
+
+        for (int i = 0; i < count; i++) {
+            Peer *peer = snapshot[i];
+            if (peer_heartbeat_due(peer) >= config.heartbeat_misses) {
+                printf("Peer %s:%d missed %d heartbeats, disconnecting\n", peer->ip, peer->port, config.heartbeat_misses);
+                peer_close(peer);
+                shutdown(peer->socket, SHUT_RDWR);
+            } else {
+                uint64_t now = monotonic_ms();
+                struct btide_packet png = { PKT_MSG_PNG, PKT_ERR_NONE, PNG_LEN, {{0}} };
+                wire_put_u32(png.pl.data, (uint32_t)now);
+                wire_put_u32(png.pl.data + 4, (uint32_t)(now >> 32));
+                peer_try_send(peer, &png);
+            }
+            release_peer(peer);
+        }
+    }
+    return NULL;
+}
+
+void start_heartbeats(void) {
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, heartbeat_worker, NULL);
+    pthread_detach(thread_id);
 }
 
+void send_interest(Peer *peer) {
+    send_notice(peer, PKT_MSG_INT);
+}
+
+// A random sample of the other peers whose listening port we know,
+// and our own port so the peer can tell others how to reach us
+void send_pex(Peer *peer) {
+    Peer *snapshot[PEER_TABLE_MAX];
+    int count = snapshot_peers(snapshot, PEER_TABLE_MAX);
+
+    struct btide_packet pex = { PKT_MSG_PEX, PKT_ERR_NONE, 0, {{0}} };
+    uint16_t n = 0;
+    for (int i = 0; i < count; i++) {
+        // Partial shuffle, so the first PEX_MAX_ADDRS taken are uniform
+        int j = i + rand() % (count - i);
+        Peer *other = snapshot[j];
+        snapshot[j] = snapshot[i];
+        uint16_t port = __atomic_load_n(&other->listen_port, __ATOMIC_ACQUIRE);
+        struct in_addr addr;
+        if (n < PEX_MAX_ADDRS && other != peer && port && inet_pton(AF_INET, other->ip, &addr) == 1) {
+            uint8_t *p = pex.pl.data + PEX_HDR_LEN + n * PEX_ENTRY_LEN;
+            memcpy(p, &addr.s_addr, 4);
+            wire_put_u16(p + 4, port);
+            n++;
+        }
+        release_peer(other);
+    }
+    wire_put_u16(pex.pl.data, config.port);
+    wire_put_u16(pex.pl.data + 2, n);
+    pex.len = PEX_HDR_LEN + (uint32_t)n * PEX_ENTRY_LEN;
+    peer_send(peer, &pex);
+}
+
+static void pex_dial_done(void *arg, int connected) {
+    (void)connected;
+    Peer *peer = (Peer *)arg;
+    __atomic_sub_fetch(&peer->pex_dials, 1, __ATOMIC_ACQ_REL);
+    release_peer(peer);
+}
+
+// Learns the peer's listening port and dials the peers it names that we
+// are not connected to, while there is room for them counting the dials
+// already under way. Each frame, and each peer, only gets a few dials,
+// and frames sent more often than every PEX_INTERVAL (less a second of
+// delivery jitter) are ignored.
+void handle_pex_packet(Peer *peer, const struct btide_packet *packet) {
+    if (packet->len < PEX_HDR_LEN) {
+        fprintf(stderr, "Malformed PEX packet\n");
+        return;
+    }
+    uint16_t listen_port = wire_get_u16(packet->pl.data);
+    uint16_t n = wire_get_u16(packet->pl.data + 2);
+    if (n > PEX_MAX_ADDRS || packet->len != PEX_HDR_LEN + (uint32_t)n * PEX_ENTRY_LEN) {
+        fprintf(stderr, "Malformed PEX packet\n");
+        return;
+    }
+    if (listen_port) {
+        __atomic_store_n(&peer->listen_port, listen_port, __ATOMIC_RELEASE);
+    }
+    uint64_t now = monotonic_ms();
+    if (peer->pex_at_ms && now - peer->pex_at_ms < PEX_INTERVAL * 1000 - 1000) {
+        return;
+    }
+    peer->pex_at_ms = now;
+
+    // An entry naming our own listening port on the address this
+    // connection reached us at, or on loopback, is ourselves
+    struct sockaddr_in local;
+    socklen_t local_len = sizeof(local);
+    if (getsockname(peer->socket, (struct sockaddr *)&local, &local_len) < 0) {
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+    int dialled = 0;
+    for (uint16_t i = 0; i < n && dialled < PEX_FRAME_DIALS; i++) {
+        if (__atomic_load_n(&peer_count, __ATOMIC_ACQUIRE) + pending_dials() >= config.max_peers
+            || __atomic_load_n(&peer->pex_dials, __ATOMIC_ACQUIRE) >= PEX_PEER_DIALS) {
+            break;
+        }
+        const uint8_t *p = packet->pl.data + PEX_HDR_LEN + i * PEX_ENTRY_LEN;
+        struct in_addr addr;
+        memcpy(&addr.s_addr, p, 4);
+        uint16_t port = wire_get_u16(p + 4);
+        if (port == 0 || (port == config.port
+            && (addr.s_addr == local.sin_addr.s_addr || (ntohl(addr.s_addr) >> 24) == 127))) {
+            continue;
+        }
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+        if (peer_known(ip, port)) {
+            continue;
+        }
+        retain_peer(peer);
+        __atomic_add_fetch(&peer->pex_dials, 1, __ATOMIC_ACQ_REL);
+        if (queue_connect(ip, port, pex_dial_done, peer) == 0) {
+            printf("Connecting to %s:%d learned from %s:%d\n", ip, port, peer->ip, peer->port);
+            dialled++;
+        } else {
+            __atomic_sub_fetch(&peer->pex_dials, 1, __ATOMIC_ACQ_REL);
+            release_peer(peer);
+        }
+    }
+}
+
+static void* pex_worker(void* arg) {
+    (void)arg;
+    while (1) {
+        sleep(PEX_INTERVAL);
+
+        Peer *snapshot[PEER_TABLE_MAX];
+        int count = snapshot_peers(snapshot, PEER_TABLE_MAX);
+        for (int i = 0; i < count; i++) {
+            send_pex(snapshot[i]);
+            release_peer(snapshot[i]);
+        }
+    }
+    return NULL;
+}
+
+void start_pex(void) {
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, pex_worker, NULL);
+    pthread_detach(thread_id);
+}
+
+typedef struct {
+    Peer *peer;
+    double rate;
+} RankedPeer;
+
+// Fastest first
+static int compare_ranked(const void *a, const void *b) {
+    double ra = ((const RankedPeer *)a)->rate;
+    double rb = ((const RankedPeer *)b)->rate;
+    return (ra < rb) - (ra > rb);
+}
+
+// Every PEER_CHOKE_INTERVAL, upload slots go to the interested peers
+// that upload to us fastest, all but one of them. The last is an
+// optimistic slot that rotates among the rest every few rounds, which
+// is how a newcomer with nothing to give gets started.
+static void* choke_worker(void* arg) {
+    (void)arg;
+    Peer *optimistic = NULL;
+    RankedPeer *ranked = malloc(sizeof(RankedPeer) * PEER_TABLE_MAX);
+    Peer **snapshot = malloc(sizeof(Peer *) * PEER_TABLE_MAX);
+    if (!ranked || !snapshot) {
+        fprintf(stderr, "Failed to allocate choke state\n");
+        free(ranked);
+        free(snapshot);
+        return NULL;
+    }
+
+    for (unsigned int round = 0; ; round++) {
+        sleep(PEER_CHOKE_INTERVAL);
+
+        int count = snapshot_peers(snapshot, PEER_TABLE_MAX);
+
+        uint64_t now = monotonic_ms();
+        int interested = 0;
+        for (int i = 0; i < count; i++) {
+            if (peer_is_interested(snapshot[i], now)) {
+                pthread_mutex_lock(&snapshot[i]->state_lock);
+                ranked[interested].rate = snapshot[i]->rx_rate;
+                pthread_mutex_unlock(&snapshot[i]->state_lock);
+                ranked[interested++].peer = snapshot[i];
+            }
+        }
+        qsort(ranked, (size_t)interested, sizeof(RankedPeer), compare_ranked);
+
+        int regular = config.upload_slots > 1 ? config.upload_slots - 1 : config.upload_slots;
+        if (regular > interested) {
+            regular = interested;
+        }
+        // Keep the optimistic peer for a few rounds unless it left or
+        // earned a regular slot
+        int keep = 0;
+        for (int i = regular; i < interested && optimistic && round % PEER_OPTIMISTIC_ROUNDS; i++) {
+            keep |= ranked[i].peer == optimistic;
+        }
+        if (!keep) {
+            optimistic = NULL;
+            if (interested > regular && config.upload_slots > 1) {
+                optimistic = ranked[regular + rand() % (interested - regular)].peer;
+            }
+        }
+
+        for (int i = 0; i < count; i++) {
+            Peer *peer = snapshot[i];
+            int unchoke = peer == optimistic;
+            for (int r = 0; r < regular && !unchoke; r++) {
+                unchoke = ranked[r].peer == peer;
+            }
+            uint16_t notify;
+            if (peer_set_choking(peer, !unchoke, &notify) && !unchoke) {
+                peer_drop_uploads(peer);
+            }
+            if (notify) {
+                send_notice(peer, notify);
+            }
+            release_peer(peer);
+        }
+    }
+    return NULL;
+}
+
+void start_choker(void) {
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, choke_worker, NULL);
+    pthread_detach(thread_id);
+}
 
 void handle_incoming_connection(int server_socket) {
     struct sockaddr_in client_addr;
     socklen_t addr_len = sizeof(client_addr);
 
     while (1) {
-        int *client_socket = malloc(sizeof(int));
-        *client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &addr_len);
-        if (*client_socket < 0) {
+        int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &addr_len);
+        if (client_socket < 0) {
             perror("Failed to accept connection");
-            free(client_socket);
             continue;
         }
 
         printf("New connection from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
 
+        Peer *peer = create_peer(inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), client_socket);
+        if (!peer) {
+            close(client_socket);
+            continue;
+        }
+
         pthread_t thread_id;
-        pthread_create(&thread_id, NULL, handle_client, client_socket);
+        pthread_create(&thread_id, NULL, handle_client, peer);
         pthread_detach(thread_id);
     }
 }
@@ -168,14 +1662,8 @@ void start_server(uint16_t port) {
 }
 
 void fetch_chunk(const char *ip, uint16_t port, const char *identifier, const char *chunk_hash, uint32_t offset) {
-    int peer_found = 0;
-    for (int i = 0; i < peer_count; ++i) {
-        if (strcmp(peers[i].ip, ip) == 0 && peers[i].port == port) {
-            peer_found = 1;
-            break;
-        }
-    }
-    if (!peer_found) {
+    Peer *peer = find_peer(ip, port);
+    if (!peer) {
         printf("Unable to request chunk, peer not in list\n");
         return;
     }
@@ -183,47 +1671,131 @@ void fetch_chunk(const char *ip, uint16_t port, const char *identifier, const ch
     Package *pkg = find_package_by_identifier(identifier);
     if (!pkg) {
         printf("Unable to request chunk, package is not managed\n");
+        release_peer(peer);
+        return;
+    }
+
+    // A running download only keeps data it asked for itself
+    if (download_is_active(pkg)) {
+        printf("Unable to request chunk, package is being downloaded\n");
+        release_peer(peer);
         return;
     }
 
     Chunk *chunk = find_chunk_by_hash(pkg, chunk_hash);
     if (!chunk) {
         printf("Unable to request chunk, chunk hash does not belong to package\n");
+        release_peer(peer);
         return;
     }
 
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("Socket creation error");
+    uint16_t handle = peer_bind_package(peer, pkg);
+    if (handle == PEER_NO_HANDLE) {
+        printf("Unable to request chunk, could not bind package on peer\n");
+        release_peer(peer);
         return;
     }
 
-    struct sockaddr_in serv_addr;
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
+    struct req_packet req;
+    req.msg_code = PKT_MSG_REQ;
+    req.error = 0;
+    req.handle = handle;
+    req.chunk_index = (uint32_t)(chunk - pkg->chunks);
+    req.file_offset = offset == FETCH_WHOLE_CHUNK ? chunk->offset : offset;
+    req.data_len = 0;
+
+    send_req_packet(peer, &req);
+    release_peer(peer);
+}
 
-    if (inet_pton(AF_INET, ip, &serv_addr.sin_addr) <= 0) {
-        perror("Invalid address/ Address not supported");
-        close(sock);
+void fetch_chunk_range(const char *ip, uint16_t port, const char *identifier, uint32_t first, uint32_t count) {
+    Peer *peer = find_peer(ip, port);
+    if (!peer) {
+        printf("Unable to request chunks, peer not in list\n");
         return;
     }
 
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("Connection failed");
-        close(sock);
+    Package *pkg = find_package_by_identifier(identifier);
+    if (!pkg) {
+        printf("Unable to request chunks, package is not managed\n");
+        release_peer(peer);
+        return;
+    }
+    // A running download only keeps data it asked for itself
+    if (download_is_active(pkg)) {
+        printf("Unable to request chunks, package is being downloaded\n");
+        release_peer(peer);
         return;
     }
 
-    struct req_packet req;
-    req.msg_code = PKT_MSG_REQ;
-    req.error = 0;
-    req.file_offset = offset;
-    req.data_len = 0;
-    strncpy(req.chunk_hash, chunk_hash, 64);
-    strncpy(req.identifier, identifier, 1024);
+    if (first >= pkg->nchunks || count > pkg->nchunks - first) {
+        printf("Unable to request chunks, range is outside of package\n");
+        release_peer(peer);
+        return;
+    }
+
+    uint16_t handle = peer_bind_package(peer, pkg);
+    if (handle == PEER_NO_HANDLE) {
+        printf("Unable to request chunks, could not bind package on peer\n");
+        release_peer(peer);
+        return;
+    }
 
-    send_req_packet(sock, &req);
+    struct brq_packet brq;
+    brq.handle = handle;
+    brq.nranges = 1;
+    brq.ranges[0].first = first;
+    brq.ranges[0].count = count;
 
-    close(sock);
+    struct btide_packet frame;
+    encode_brq_packet(&brq, &frame);
+    peer_send(peer, &frame);
+    release_peer(peer);
 }
 
+void fetch_subtree(const char *ip, uint16_t port, const char *identifier, const char *hash) {
+    Peer *peer = find_peer(ip, port);
+    if (!peer) {
+        printf("Unable to request subtree, peer not in list\n");
+        return;
+    }
+
+    Package *pkg = find_package_by_identifier(identifier);
+    if (!pkg) {
+        printf("Unable to request subtree, package is not managed\n");
+        release_peer(peer);
+        return;
+    }
+
+    // A running download only keeps data it asked for itself
+    if (download_is_active(pkg)) {
+        printf("Unable to request subtree, package is being downloaded\n");
+        release_peer(peer);
+        return;
+    }
+
+    int node = find_merkle_node(pkg, hash);
+    if (node < 0) {
+        printf("Unable to request subtree, hash is not a node of the package tree\n");
+        release_peer(peer);
+        return;
+    }
+
+    uint16_t handle = peer_bind_package(peer, pkg);
+    if (handle == PEER_NO_HANDLE) {
+        printf("Unable to request subtree, could not bind package on peer\n");
+        release_peer(peer);
+        return;
+    }
+    if (peer_track_subtree(peer, pkg, (uint32_t)node) < 0) {
+        printf("Unable to request subtree, too many subtree fetches in flight\n");
+        release_peer(peer);
+        return;
+    }
+
+    struct btide_packet frame = { PKT_MSG_SRQ, PKT_ERR_NONE, SRQ_LEN, {{0}} };
+    wire_put_u16(frame.pl.data, handle);
+    hex_to_digest(merkle_node_hash(pkg, (uint32_t)node), frame.pl.data + 2);
+    peer_send(peer, &frame);
+    release_peer(peer);
+}
@@ -1,6 +1,9 @@
 #ifndef NETWORK_H
 #define NETWORK_H
 #include <stdint.h>
+#include <stddef.h>
+#include "package.h"
+#include "peer.h"
 #define PAYLOAD_MAX 4096
 // Define the packet message codes
 #define PKT_MSG_ACK 0x0c
@@ -8,8 +11,96 @@
 #define PKT_MSG_DSN 0x03
 #define PKT_MSG_REQ 0x06
 #define PKT_MSG_RES 0x07
+// Heartbeat and its echo: u64 send time in the pinger's monotonic ms
 #define PKT_MSG_PNG 0xFF
 #define PKT_MSG_POG 0x00
+#define PNG_LEN 8
+// Binds a package identifier to a per-connection handle, and its reply
+#define PKT_MSG_BND 0x08
+#define PKT_MSG_BNA 0x09
+// Batched request for one or more runs of chunk indices
+#define PKT_MSG_BRQ 0x0a
+// Request for every chunk under a Merkle node: u16 handle | node digest
+#define PKT_MSG_SRQ 0x0b
+#define SRQ_LEN (2 + DIGEST_LEN)
+// Flow control credit: u32 number of RES data frames consumed
+#define PKT_MSG_WND 0x0d
+// Availability: one chunk became complete, or a run of the bitfield
+#define PKT_MSG_HAV 0x0e
+#define PKT_MSG_BFD 0x0f
+// Withdraws a chunk request: u16 handle | u32 chunk index
+#define PKT_MSG_CAN 0x10
+#define CAN_LEN 6
+// Upload slots: the sender stops or resumes serving our requests, and
+// a choked downloader tells the uploader it still wants data
+#define PKT_MSG_CHK 0x11
+#define PKT_MSG_UNC 0x12
+#define PKT_MSG_INT 0x13
+// Peer exchange: u16 our listening port | u16 count | count * (IPv4
+// address in network order | u16 port), a sample of the peers we are
+// connected to
+#define PKT_MSG_PEX 0x14
+#define PEX_HDR_LEN 4
+#define PEX_ENTRY_LEN 6
+#define PEX_MAX_ADDRS 50
+// Seconds between the PEX frames each peer is sent after the first,
+// which goes out as soon as the connection is up
+#define PEX_INTERVAL 30
+// Most dials one PEX frame may start, and most a peer's frames may have
+// in flight at once
+#define PEX_FRAME_DIALS 8
+#define PEX_PEER_DIALS 16
+
+// Error codes carried in the frame header
+#define PKT_ERR_NONE 0
+#define PKT_ERR_NO_PACKAGE 1
+#define PKT_ERR_NO_CHUNK 2
+#define PKT_ERR_BAD_HANDLE 3
+#define PKT_ERR_NO_NODE 4
+
+// Frame header on the wire, all fields little-endian:
+//   u32 payload length | u16 msg_code | u16 error
+// followed by exactly `payload length` bytes.
+#define FRAME_HDR_LEN 8
+
+#define IDENT_MAX 1024
+
+// Encoded headers: u16 handle | u32 chunk index | u32 file offset | u32 length
+#define REQ_HDR_LEN (2 + 4 + 4 + 4)
+#define RES_HDR_LEN (2 + 4 + 4 + 4)
+#define RES_DATA_MAX (PAYLOAD_MAX - RES_HDR_LEN)
+
+// BRQ: u16 handle | u16 nranges | nranges * (u32 first index | u32 count)
+#define BRQ_HDR_LEN 4
+#define BRQ_RANGE_LEN 8
+#define BRQ_MAX_RANGES ((PAYLOAD_MAX - BRQ_HDR_LEN) / BRQ_RANGE_LEN)
+// Upper bound on what one preadv pulls in while serving a batch
+#define BATCH_MAX_CHUNKS 64
+#define BATCH_MAX_BYTES (4 * 1024 * 1024)
+// HAV/BFD may name a handle bound by either side of the connection
+#define HANDLE_SENDER 0
+#define HANDLE_RECEIVER 1
+// HAV: u16 handle | u8 scope | u8 reserved | u32 chunk index
+#define HAV_LEN 8
+// BFD: u16 handle | u8 scope | u8 encoding | u32 first bit | u32 nbits | body
+#define BFD_HDR_LEN 12
+// Raw body is a bitmap; RLE body is the first bit value followed by
+// LEB128 lengths of alternating runs; NODES body is the digests of the
+// fewest Merkle nodes covering exactly the complete chunks
+#define BFD_ENC_RAW 0
+#define BFD_ENC_RLE 1
+#define BFD_ENC_NODES 2
+#define BFD_MAX_NODES ((PAYLOAD_MAX - BFD_HDR_LEN) / DIGEST_LEN)
+
+// Times a chunk may fail verification before we stop re-requesting it
+#define CHUNK_MAX_FAILURES 3
+// Chunks bigger than a batch are streamed from disk in blocks this size
+#define STREAM_BLOCK_BYTES (256 * 1024)
+// How often a reader holding back credit for a full disk queue looks
+// again, as nothing wakes it when the queue drains
+#define DISK_RECHECK_MS 10
+// A FETCH without a file offset asks for the whole chunk
+#define FETCH_WHOLE_CHUNK UINT32_MAX
 
 union btide_payload {
     uint8_t data[PAYLOAD_MAX];
@@ -18,38 +109,89 @@ union btide_payload {
 struct btide_packet {
     uint16_t msg_code;
     uint16_t error;
+    uint32_t len;
     union btide_payload pl;
 };
 
 struct req_packet {
     uint16_t msg_code;
     uint16_t error;
+    uint16_t handle;
+    uint32_t chunk_index;
     uint32_t file_offset;
-    uint16_t data_len;
-    char chunk_hash[64];
-    char identifier[1024];
+    uint32_t data_len;
+};
+
+struct chunk_range {
+    uint32_t first;
+    uint32_t count;
+};
+
+struct brq_packet {
+    uint16_t handle;
+    uint16_t nranges;
+    struct chunk_range ranges[BRQ_MAX_RANGES];
 };
 
 struct res_packet {
     uint16_t msg_code;
     uint16_t error;
+    uint16_t handle;
+    uint32_t chunk_index;
     uint32_t file_offset;
-    uint16_t data_len;
-    char data[2998];
-    char chunk_hash[64];
-    char identifier[1024];
+    uint32_t data_len;
+    char data[RES_DATA_MAX];
 };
 
-void send_packet(int socket, const struct btide_packet *packet);
-void receive_packet(int socket, struct btide_packet *packet);
+uint64_t monotonic_ms(void);
+void wire_put_u16(uint8_t *p, uint16_t v);
+void wire_put_u32(uint8_t *p, uint32_t v);
+uint16_t wire_get_u16(const uint8_t *p);
+uint32_t wire_get_u32(const uint8_t *p);
+
+int send_packet(int socket, const struct btide_packet *packet);
+int receive_packet(int socket, struct btide_packet *packet);
 void handle_incoming_connection(int server_socket);
 void start_server(uint16_t port);
 void* handle_client(void* arg);
+void handle_pog_packet(Peer *peer, const struct btide_packet *packet);
+void start_heartbeats(void);
+void send_interest(Peer *peer);
+void handle_int_packet(Peer *peer);
+void start_choker(void);
+void send_pex(Peer *peer);
+void handle_pex_packet(Peer *peer, const struct btide_packet *packet);
+void start_pex(void);
+
+void encode_bnd_packet(uint16_t handle, const char *identifier, struct btide_packet *packet);
+void handle_bnd_packet(Peer *peer, const struct btide_packet *packet);
+void handle_bna_packet(Peer *peer, const struct btide_packet *packet);
+
+int encode_req_packet(const struct req_packet *req, struct btide_packet *packet);
+int decode_req_packet(const struct btide_packet *packet, struct req_packet *req);
+int encode_res_packet(const struct res_packet *res, struct btide_packet *packet);
+int decode_res_packet(const struct btide_packet *packet, struct res_packet *res);
+
+int encode_brq_packet(const struct brq_packet *brq, struct btide_packet *packet);
+int decode_brq_packet(const struct btide_packet *packet, struct brq_packet *brq);
 
-void send_req_packet(int socket, const struct req_packet *packet);
-void handle_req_packet(int client_socket, const struct req_packet *packet);
-void send_res_packet(int socket, const struct res_packet *packet);
-void handle_res_packet(int client_socket, const struct res_packet *packet);
+int send_req_packet(Peer *peer, const struct req_packet *packet);
+void handle_brq_packet(Peer *peer, const struct brq_packet *packet);
+void handle_srq_packet(Peer *peer, const struct btide_packet *packet);
+void handle_wnd_packet(Peer *peer, const struct btide_packet *packet);
+void send_bitfield(Peer *peer, uint16_t handle, int scope, Package *pkg);
+void handle_bfd_packet(Peer *peer, const struct btide_packet *packet);
+void handle_hav_packet(Peer *peer, const struct btide_packet *packet);
+int send_have(Peer *peer, Package *pkg, uint32_t index);
+void broadcast_have(Package *pkg, uint32_t index);
+void* upload_worker(void* arg);
+void handle_req_packet(Peer *peer, const struct req_packet *packet);
+void send_can_packet(Peer *peer, uint16_t handle, uint32_t chunk_index);
+void handle_can_packet(Peer *peer, const struct btide_packet *packet);
+int send_res_packet(Peer *peer, const struct res_packet *packet);
+void handle_res_packet(Peer *peer, const struct res_packet *packet);
 void fetch_chunk(const char *ip, uint16_t port, const char *identifier, const char *chunk_hash, uint32_t offset);
+void fetch_chunk_range(const char *ip, uint16_t port, const char *identifier, uint32_t first, uint32_t count);
+void fetch_subtree(const char *ip, uint16_t port, const char *identifier, const char *hash);
 
 #endif
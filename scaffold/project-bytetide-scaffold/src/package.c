@@ -1,12 +1,43 @@
+#define _GNU_SOURCE
 #include "package.h"
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "crypt/sha256.h"
+#include "epoch.h"
 
 Package **packages = NULL;
 int package_count = 0;
 
+typedef struct {
+    uint64_t fingerprint;
+    Package *pkg;
+} IndexSlot;
+
+typedef struct PackageIndex {
+    uint32_t mask;
+    // Slots with a fingerprint, removed packages' tombstones included
+    uint32_t used;
+    IndexSlot slots[];
+} PackageIndex;
+
+// Readers load the current table and probe it without a lock, inside an
+// epoch critical section. Writers serialise on registry_mutex, fill a
+// slot's package before its fingerprint, and publish a bigger copy when
+// the table passes half full. A removed package leaves its fingerprint
+// behind with no package so probes keep walking past it. Outgrown
+// tables are retired to the epoch reclaimer.
+static PackageIndex *registry = NULL;
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int hex_value(char c);
+static int build_digest_index(Package *pkg);
+
 void clear_rest_line(FILE *file, char buffer[]) {
     if (strchr(buffer, '\n') == NULL) {
         int c;
@@ -15,11 +46,16 @@ void clear_rest_line(FILE *file, char buffer[]) {
 }
 
 Package *load_package(const char *path) {
-    Package *pkg = malloc(sizeof(Package));
+    Package *pkg = calloc(1, sizeof(Package));
     if (pkg == NULL) {
         fprintf(stderr, "Memory allocation failed for Package\n");
         return NULL;
     }
+    pkg->fd = -1;
+    pkg->refs = 1;
+    pthread_mutex_init(&pkg->lock, NULL);
+    bucket_init(&pkg->upload_limit, config.package_upload_rate, config.rate_burst);
+    bucket_init(&pkg->download_limit, config.package_download_rate, config.rate_burst);
 
     FILE *file = fopen(path, "r");
     if (file == NULL) {
@@ -40,6 +76,7 @@ Package *load_package(const char *path) {
     buffer[strcspn(buffer, "\r\n")] = 0;
     strncpy(pkg->ident, buffer + 6, sizeof(pkg->ident) - 1);
     pkg->ident[sizeof(pkg->ident) - 1] = '\0';
+    pkg->fingerprint = ident_fingerprint(pkg->ident);
     printf("Ident: %s\n", pkg->ident);
 
     clear_rest_line(file, buffer);
@@ -63,10 +100,40 @@ Package *load_package(const char *path) {
     }
     printf("Size: %u\n", pkg->size);
 
+    if (!fgets(buffer, sizeof(buffer), file) || sscanf(buffer, "nhashes:%u", &pkg->nhashes) != 1) {
+        fprintf(stderr, "Failed to parse nhashes.\n");
+        fclose(file);
+        free(pkg);
+        return NULL;
+    }
+
+    fgets(buffer, sizeof(buffer), file);
+
+    pkg->hashes = calloc(pkg->nhashes ? pkg->nhashes : 1, sizeof(char *));
+    if (pkg->hashes == NULL) {
+        fprintf(stderr, "Failed to allocate memory for hashes\n");
+        fclose(file);
+        free(pkg);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < pkg->nhashes; i++) {
+        char *hash = NULL;
+        if (fgets(buffer, sizeof(buffer), file)) {
+            hash = strtok(buffer, "\t\r\n");
+        }
+        pkg->hashes[i] = hash ? strdup(hash) : NULL;
+        if (pkg->hashes[i] == NULL) {
+            fprintf(stderr, "Failed to read hash %u\n", i);
+            fclose(file);
+            free_package(pkg);
+            return NULL;
+        }
+    }
+
     if (!fgets(buffer, sizeof(buffer), file) || sscanf(buffer, "nchunks:%u", &pkg->nchunks) != 1) {
         fprintf(stderr, "Failed to parse nchunks.\n");
         fclose(file);
-        free(pkg);
+        free_package(pkg);
         return NULL;
     }
     printf("Nchunks: %u\n", pkg->nchunks);
@@ -76,11 +143,11 @@ Package *load_package(const char *path) {
     char line[256];
     int index = 0;
     unsigned long tempOffset, tempSize;
-    pkg->chunks = malloc(pkg->nchunks * sizeof(Chunk));
+    pkg->chunks = calloc(pkg->nchunks ? pkg->nchunks : 1, sizeof(Chunk));
     if (pkg->chunks == NULL) {
         fprintf(stderr, "Failed to allocate memory for chunks\n");
         fclose(file);
-        free(pkg);
+        free_package(pkg);
         return NULL;
     }
 
@@ -91,11 +158,11 @@ Package *load_package(const char *path) {
         if (pkg->chunks[index].hash == NULL) {
             fprintf(stderr, "Failed to allocate memory for hash\n");
             fclose(file);
-            free(pkg->chunks);
-            free(pkg);
+            free_package(pkg);
             return NULL;
         }
 
+        pkg->chunks[index].hash[0] = '\0';
         int result = sscanf(clean_line, "%64[^,],%lu,%lu", pkg->chunks[index].hash, &tempOffset, &tempSize);
         if (result != 3) {
             printf("DID NOT READ ALL DATA!");
@@ -111,40 +178,541 @@ Package *load_package(const char *path) {
     }
 
     fclose(file);
+
+    int created = 0;
+    pkg->completed = calloc((pkg->nchunks + 7) / 8 + 1, 1);
+    if (index != (int)pkg->nchunks || !pkg->completed || build_digest_index(pkg) < 0
+        || open_package_data(pkg, &created) < 0) {
+        free_package(pkg);
+        return NULL;
+    }
+    if (!created) {
+        scan_package_data(pkg);
+    }
     return pkg;
 }
 
+// Opens (creating if needed) the data file inside the configured
+// directory. The fd stays open for the lifetime of the package so
+// chunk reads and writes can use pread/pwrite without reopening.
+int open_package_data(Package *pkg, int *created) {
+    snprintf(pkg->path, sizeof(pkg->path), "%s/%s", config.directory, pkg->filename);
+    pkg->fd = open(pkg->path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    *created = pkg->fd >= 0;
+    if (pkg->fd < 0 && errno == EEXIST) {
+        pkg->fd = open(pkg->path, O_RDWR);
+    }
+    if (pkg->fd < 0) {
+        perror("Failed to open package data");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(pkg->fd, &st) == 0 && st.st_size < (off_t)pkg->size) {
+        if (ftruncate(pkg->fd, pkg->size) != 0) {
+            perror("Failed to size package data");
+        }
+    }
+    return 0;
+}
+
+// Hashes whatever is already on disk so existing data is served and
+// not downloaded again. Only done once, when the package is added.
+void scan_package_data(Package *pkg) {
+    char hex[DIGEST_LEN * 2 + 1];
+    for (uint32_t i = 0; i < pkg->nchunks; i++) {
+        if (hash_chunk_data(pkg, i, hex) == 0 && strcmp(hex, pkg->chunks[i].hash) == 0) {
+            pkg->completed[i / 8] |= (uint8_t)(1 << (i % 8));
+            pkg->completed_count++;
+        }
+    }
+}
+
+int chunk_is_complete(const Package *pkg, uint32_t index) {
+    return (__atomic_load_n(&pkg->completed[index / 8], __ATOMIC_ACQUIRE) >> (index % 8)) & 1;
+}
+
+int package_is_complete(const Package *pkg) {
+    return __atomic_load_n(&pkg->completed_count, __ATOMIC_ACQUIRE) == pkg->nchunks;
+}
+
+// Marks a chunk complete if digest is its expected hash. Returns 1 when
+// committed, 0 when it was already complete and -1 on a mismatch.
+int commit_chunk(Package *pkg, uint32_t index, const uint8_t digest[DIGEST_LEN]) {
+    uint8_t expected[DIGEST_LEN];
+    if (hex_to_digest(pkg->chunks[index].hash, expected) < 0 || memcmp(expected, digest, DIGEST_LEN) != 0) {
+        pthread_mutex_lock(&pkg->lock);
+        if (pkg->chunks[index].failures < UINT8_MAX) {
+            pkg->chunks[index].failures++;
+        }
+        pthread_mutex_unlock(&pkg->lock);
+        return -1;
+    }
+
+    pthread_mutex_lock(&pkg->lock);
+    int fresh = !chunk_is_complete(pkg, index);
+    if (fresh) {
+        __atomic_fetch_or(&pkg->completed[index / 8], (uint8_t)(1 << (index % 8)), __ATOMIC_RELEASE);
+        __atomic_add_fetch(&pkg->completed_count, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&pkg->lock);
+    return fresh;
+}
+
 void free_package(Package *pkg) {
     if (pkg) {
-        for (unsigned int i = 0; i < pkg->nchunks; ++i) {
-            free(pkg->chunks[i].hash);
+        if (pkg->chunks) {
+            for (unsigned int i = 0; i < pkg->nchunks; ++i) {
+                free(pkg->chunks[i].hash);
+            }
+        }
+        if (pkg->hashes) {
+            for (unsigned int i = 0; i < pkg->nhashes; ++i) {
+                free(pkg->hashes[i]);
+            }
+        }
+        if (pkg->fd >= 0) {
+            close(pkg->fd);
         }
+        pthread_mutex_destroy(&pkg->lock);
+        free(pkg->digest_slots);
+        free(pkg->digest_next);
+        free(pkg->completed);
+        free(pkg->hashes);
         free(pkg->chunks);
         free(pkg);
     }
 }
 
+// FNV-1a over the characters lookups compare, never 0 as that marks
+// an empty slot
+uint64_t ident_fingerprint(const char *identifier) {
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < 32 && identifier[i]; i++) {
+        h ^= (uint8_t)identifier[i];
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
 Package* find_package_by_identifier(const char *identifier) {
-    for (int i = 0; i < package_count; ++i) {
-        if (strncmp(packages[i]->ident, identifier, 32) == 0) {
-            return packages[i];
+    PackageIndex *index = __atomic_load_n(&registry, __ATOMIC_ACQUIRE);
+    if (!index) {
+        return NULL;
+    }
+    uint64_t fingerprint = ident_fingerprint(identifier);
+    for (uint32_t i = (uint32_t)fingerprint & index->mask;; i = (i + 1) & index->mask) {
+        IndexSlot *slot = &index->slots[i];
+        uint64_t seen = __atomic_load_n(&slot->fingerprint, __ATOMIC_ACQUIRE);
+        if (seen == 0) {
+            return NULL;
+        }
+        if (seen == fingerprint) {
+            Package *pkg = __atomic_load_n(&slot->pkg, __ATOMIC_ACQUIRE);
+            if (pkg && strncmp(pkg->ident, identifier, 32) == 0) {
+                return pkg;
+            }
         }
     }
-    return NULL;
 }
 
-Chunk* find_chunk_by_hash(Package *pkg, const char *chunk_hash) {
-    for (unsigned int i = 0; i < pkg->nchunks; ++i) {
-        if (strcmp(pkg->chunks[i].hash, chunk_hash) == 0) {
-            return &pkg->chunks[i];
+// Digests are uniformly random, so their first eight bytes make a good
+// table key. Returns -1 if the hash does not start with 16 hex digits.
+static int digest_key(const char *hash, uint64_t *key) {
+    uint64_t k = 0;
+    for (int i = 0; i < 16; i++) {
+        int v = hex_value(hash[i]);
+        if (v < 0) {
+            return -1;
         }
+        k = k << 4 | (uint64_t)v;
     }
-    return NULL;
+    *key = k ^ (k >> 32);
+    return 0;
 }
 
-// Add package to the global list (example function)
-void add_package_to_list(Package *pkg) {
-    packages = realloc(packages, (package_count + 1) * sizeof(Package *));
+// Nodes are inserted from the highest down and each goes to the front
+// of its digest's chain, so chains come out in node order
+static int build_digest_index(Package *pkg) {
+    uint32_t nodes = pkg->nhashes + pkg->nchunks;
+    uint32_t size = 16;
+    while (size < nodes * 2) {
+        size *= 2;
+    }
+    pkg->digest_slots = malloc(size * sizeof(uint32_t));
+    pkg->digest_next = malloc((nodes ? nodes : 1) * sizeof(uint32_t));
+    if (!pkg->digest_slots || !pkg->digest_next) {
+        fprintf(stderr, "Failed to allocate digest index\n");
+        return -1;
+    }
+    pkg->digest_mask = size - 1;
+    memset(pkg->digest_slots, 0xff, size * sizeof(uint32_t));
+
+    for (uint32_t node = nodes; node-- > 0;) {
+        const char *hash = merkle_node_hash(pkg, node);
+        uint64_t key;
+        pkg->digest_next[node] = PACKAGE_NO_NODE;
+        if (digest_key(hash, &key) < 0) {
+            continue;
+        }
+        uint32_t i = (uint32_t)key & pkg->digest_mask;
+        while (pkg->digest_slots[i] != PACKAGE_NO_NODE
+            && strcmp(merkle_node_hash(pkg, pkg->digest_slots[i]), hash) != 0) {
+            i = (i + 1) & pkg->digest_mask;
+        }
+        pkg->digest_next[node] = pkg->digest_slots[i];
+        pkg->digest_slots[i] = node;
+    }
+    return 0;
+}
+
+// The lowest node with the given hash, or PACKAGE_NO_NODE
+static uint32_t find_digest(const Package *pkg, const char *hash) {
+    uint64_t key;
+    if (!pkg->digest_slots || digest_key(hash, &key) < 0) {
+        return PACKAGE_NO_NODE;
+    }
+    for (uint32_t i = (uint32_t)key & pkg->digest_mask;; i = (i + 1) & pkg->digest_mask) {
+        uint32_t node = pkg->digest_slots[i];
+        if (node == PACKAGE_NO_NODE || strcmp(merkle_node_hash(pkg, node), hash) == 0) {
+            return node;
+        }
+    }
+}
+
+// Interior nodes sort before chunks, so the first chunk on the chain is
+// the earliest chunk with the hash
+Chunk* find_chunk_by_hash(Package *pkg, const char *chunk_hash) {
+    uint32_t node = find_digest(pkg, chunk_hash);
+    while (node != PACKAGE_NO_NODE && node < pkg->nhashes) {
+        node = pkg->digest_next[node];
+    }
+    return node == PACKAGE_NO_NODE ? NULL : &pkg->chunks[node - pkg->nhashes];
+}
+
+static void index_insert(PackageIndex *index, Package *pkg) {
+    uint32_t i = (uint32_t)pkg->fingerprint & index->mask;
+    while (index->slots[i].fingerprint != 0) {
+        i = (i + 1) & index->mask;
+    }
+    __atomic_store_n(&index->slots[i].pkg, pkg, __ATOMIC_RELAXED);
+    __atomic_store_n(&index->slots[i].fingerprint, pkg->fingerprint, __ATOMIC_RELEASE);
+    index->used++;
+}
+
+// Publishes pkg to lookups and the listing. Returns -1 if a package
+// with the same identifier is already managed or memory runs out.
+int add_package_to_list(Package *pkg) {
+    pthread_mutex_lock(&registry_mutex);
+    if (find_package_by_identifier(pkg->ident)) {
+        pthread_mutex_unlock(&registry_mutex);
+        return -1;
+    }
+    Package **list = realloc(packages, (package_count + 1) * sizeof(Package *));
+    if (!list) {
+        pthread_mutex_unlock(&registry_mutex);
+        return -1;
+    }
+    packages = list;
+
+    PackageIndex *index = registry;
+    if (!index || (index->used + 1) * 2 > index->mask + 1) {
+        // Sized from the live packages, leaving tombstones behind
+        uint32_t size = PACKAGE_INDEX_MIN;
+        while (size < (uint32_t)(package_count + 1) * 4) {
+            size *= 2;
+        }
+        PackageIndex *grown = calloc(1, sizeof(PackageIndex) + size * sizeof(IndexSlot));
+        if (!grown) {
+            pthread_mutex_unlock(&registry_mutex);
+            return -1;
+        }
+        grown->mask = size - 1;
+        for (uint32_t i = 0; index && i <= index->mask; i++) {
+            if (index->slots[i].pkg) {
+                index_insert(grown, index->slots[i].pkg);
+            }
+        }
+        if (index) {
+            epoch_retire(free, index);
+        }
+        index = grown;
+    }
+    index_insert(index, pkg);
+    __atomic_store_n(&registry, index, __ATOMIC_RELEASE);
     packages[package_count++] = pkg;
+    pthread_mutex_unlock(&registry_mutex);
+    return 0;
+}
+
+static void destroy_package(void *pkg) {
+    free_package((Package *)pkg);
+}
+
+// The caller must already hold a reference, or know the registry's is
+// still there
+void retain_package(Package *pkg) {
+    __atomic_add_fetch(&pkg->refs, 1, __ATOMIC_RELAXED);
+}
+
+// The last reference retires the package, which is freed once no
+// thread can still be looking at it
+void release_package(Package *pkg) {
+    if (__atomic_sub_fetch(&pkg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        epoch_retire(destroy_package, pkg);
+    }
+}
+
+// Takes a reference unless the last one is already gone
+static int try_retain_package(Package *pkg) {
+    int refs = __atomic_load_n(&pkg->refs, __ATOMIC_ACQUIRE);
+    while (refs > 0) {
+        if (__atomic_compare_exchange_n(&pkg->refs, &refs, refs + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Looks a package up and takes a reference, so the caller may block
+// while using it. NULL if it is not managed or is on its way out.
+Package* acquire_package_by_identifier(const char *identifier) {
+    epoch_enter();
+    Package *pkg = find_package_by_identifier(identifier);
+    if (pkg && !try_retain_package(pkg)) {
+        pkg = NULL;
+    }
+    epoch_exit();
+    return pkg;
+}
+
+int package_is_removed(const Package *pkg) {
+    return __atomic_load_n(&pkg->removed, __ATOMIC_ACQUIRE);
 }
 
+// Takes pkg out of lookups and the listing and marks it removed, after
+// which nothing may keep a new reference to it. Returns -1 if it was
+// not managed.
+int remove_package_from_list(Package *pkg) {
+    pthread_mutex_lock(&registry_mutex);
+    int at = -1;
+    for (int i = 0; i < package_count; i++) {
+        if (packages[i] == pkg) {
+            at = i;
+        }
+    }
+    if (at < 0) {
+        pthread_mutex_unlock(&registry_mutex);
+        return -1;
+    }
+    __atomic_store_n(&pkg->removed, 1, __ATOMIC_SEQ_CST);
+    PackageIndex *index = registry;
+    for (uint32_t i = 0; i <= index->mask; i++) {
+        if (index->slots[i].pkg == pkg) {
+            __atomic_store_n(&index->slots[i].pkg, NULL, __ATOMIC_RELEASE);
+        }
+    }
+    memmove(&packages[at], &packages[at + 1], (package_count - at - 1) * sizeof(Package *));
+    package_count--;
+    pthread_mutex_unlock(&registry_mutex);
+    return 0;
+}
+
+
+// The bpkg hashes section lists the interior Merkle nodes in level
+// order, so with the chunks appended the tree is an implicit heap:
+// node i has children 2i+1 and 2i+2, and leaf node nhashes + j is
+// chunk j. Only complete trees (nhashes == nchunks - 1) have that shape.
+int has_merkle_tree(const Package *pkg) {
+    return pkg->nchunks > 0 && pkg->nhashes == pkg->nchunks - 1;
+}
+
+const char* merkle_node_hash(const Package *pkg, uint32_t node) {
+    if (node < pkg->nhashes) {
+        return pkg->hashes[node];
+    }
+    return pkg->chunks[node - pkg->nhashes].hash;
+}
+
+int find_merkle_node(const Package *pkg, const char *hash) {
+    if (!has_merkle_tree(pkg)) {
+        return -1;
+    }
+    uint32_t node = find_digest(pkg, hash);
+    return node == PACKAGE_NO_NODE ? -1 : (int)node;
+}
+
+// Like find_merkle_node, but only for nodes whose chunks start at or
+// after first_chunk, taking the earliest. Identical chunks share a hash,
+// so a list of nodes in chunk order resolves by walking forward. Chunks
+// on a chain come in order, so the first one that qualifies ends it.
+int find_merkle_node_from(const Package *pkg, const char *hash, uint32_t first_chunk) {
+    if (!has_merkle_tree(pkg)) {
+        return -1;
+    }
+    int best = -1;
+    uint32_t best_first = 0;
+    for (uint32_t node = find_digest(pkg, hash); node != PACKAGE_NO_NODE; node = pkg->digest_next[node]) {
+        uint32_t first, count;
+        merkle_chunk_range(pkg, node, &first, &count);
+        if (first < first_chunk || (best >= 0 && first >= best_first)) {
+            continue;
+        }
+        best = (int)node;
+        best_first = first;
+        if (node >= pkg->nhashes) {
+            break;
+        }
+    }
+    return best;
+}
+
+// Leaves under a node are contiguous: follow the leftmost and
+// rightmost paths down to find the first and last chunk
+void merkle_chunk_range(const Package *pkg, uint32_t node, uint32_t *first, uint32_t *count) {
+    uint32_t left = node;
+    uint32_t right = node;
+    while (left < pkg->nhashes) {
+        left = left * 2 + 1;
+        right = right * 2 + 2;
+    }
+    *first = left - pkg->nhashes;
+    *count = right - left + 1;
+}
+
+// Post-order walk: complete leaves are appended, and a node whose two
+// children turn out complete replaces their entries at the tail. At
+// most one entry per tree level is ever pending a merge, so the walk
+// gives up once the list outgrows cap by more than the tree depth.
+static int collect_complete(const Package *pkg, uint32_t node, uint32_t *nodes, int *count, int cap) {
+    if (*count < 0) {
+        return 0;
+    }
+    if (node >= pkg->nhashes) {
+        if (!chunk_is_complete(pkg, node - pkg->nhashes)) {
+            return 0;
+        }
+        if (*count >= cap) {
+            *count = -1;
+            return 0;
+        }
+        nodes[(*count)++] = node;
+        return 1;
+    }
+    int left = collect_complete(pkg, node * 2 + 1, nodes, count, cap);
+    int right = collect_complete(pkg, node * 2 + 2, nodes, count, cap);
+    if (!left || !right || *count < 0) {
+        return 0;
+    }
+    *count -= 2;
+    nodes[(*count)++] = node;
+    return 1;
+}
+
+// The smallest set of Merkle nodes whose subtrees are exactly the
+// complete chunks, in chunk order. Returns the count, or -1 if the
+// package has no tree or the set would need more than max nodes.
+int min_completed_nodes(const Package *pkg, uint32_t *nodes, int max) {
+    if (!has_merkle_tree(pkg)) {
+        return -1;
+    }
+    int cap = max + 33;
+    uint32_t *work = malloc(sizeof(uint32_t) * (size_t)cap);
+    if (!work) {
+        return -1;
+    }
+    int count = 0;
+    collect_complete(pkg, 0, work, &count, cap);
+    if (count > max) {
+        count = -1;
+    }
+    if (count > 0) {
+        memcpy(nodes, work, sizeof(uint32_t) * (size_t)count);
+    }
+    free(work);
+    return count;
+}
+
+int hash_chunk_data(Package *pkg, uint32_t index, char hex[DIGEST_LEN * 2 + 1]) {
+    Chunk *chunk = &pkg->chunks[index];
+    char *buf = malloc(chunk->size ? chunk->size : 1);
+    if (!buf) {
+        fprintf(stderr, "Failed to allocate chunk buffer\n");
+        return -1;
+    }
+    if (pread(pkg->fd, buf, chunk->size, chunk->offset) != (ssize_t)chunk->size) {
+        free(buf);
+        return -1;
+    }
+
+    struct sha256_compute_data data;
+    uint8_t digest[DIGEST_LEN];
+    sha256_compute_data_init(&data);
+    sha256_update(&data, buf, chunk->size);
+    sha256_finalize(&data, digest);
+    sha256_output(&data, digest);
+    digest_to_hex(digest, hex);
+    free(buf);
+    return 0;
+}
+
+static int compute_node_hash(Package *pkg, uint32_t node, char hex[DIGEST_LEN * 2 + 1]) {
+    if (node >= pkg->nhashes) {
+        // Committed or not, a leaf is what its data on disk hashes to
+        return hash_chunk_data(pkg, node - pkg->nhashes, hex);
+    }
+
+    char combined[DIGEST_LEN * 4 + 1];
+    if (compute_node_hash(pkg, node * 2 + 1, combined) < 0
+        || compute_node_hash(pkg, node * 2 + 2, combined + DIGEST_LEN * 2) < 0) {
+        return -1;
+    }
+
+    struct sha256_compute_data data;
+    uint8_t digest[DIGEST_LEN];
+    sha256_compute_data_init(&data);
+    sha256_update(&data, combined, DIGEST_LEN * 4);
+    sha256_finalize(&data, digest);
+    sha256_output(&data, digest);
+    digest_to_hex(digest, hex);
+    return 0;
+}
+
+// Rehashes the chunks under node from disk and folds them up to node.
+// Returns 1 if it matches the package, 0 if not, -1 on error.
+int verify_subtree(Package *pkg, uint32_t node) {
+    char hex[DIGEST_LEN * 2 + 1];
+    if (compute_node_hash(pkg, node, hex) < 0) {
+        return -1;
+    }
+    return strcmp(hex, merkle_node_hash(pkg, node)) == 0;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Converts a 64 character hex hash into its 32 byte binary form
+int hex_to_digest(const char *hex, uint8_t digest[DIGEST_LEN]) {
+    for (int i = 0; i < DIGEST_LEN; ++i) {
+        int hi = hex_value(hex[i * 2]);
+        int lo = (hi < 0) ? -1 : hex_value(hex[i * 2 + 1]);
+        if (lo < 0) {
+            return -1;
+        }
+        digest[i] = (uint8_t)((hi << 4) | lo);
+    }
+    return 0;
+}
+
+void digest_to_hex(const uint8_t digest[DIGEST_LEN], char hex[DIGEST_LEN * 2 + 1]) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < DIGEST_LEN; ++i) {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0x0f];
+    }
+    hex[DIGEST_LEN * 2] = '\0';
+}
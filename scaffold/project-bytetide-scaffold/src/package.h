@@ -3,31 +3,96 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <pthread.h>
+#include "ratelimit.h"
 
+#define DIGEST_LEN 32
 
 typedef struct {
     char *hash;
     uint32_t offset;
     uint32_t size;
+    // Verification failures so far, guarded by the package lock
+    uint8_t failures;
 } Chunk;
 
 typedef struct {
     char ident[33];
+    // Hash of ident, the key of the package registry
+    uint64_t fingerprint;
     char filename[256];
+    char path[512];
+    int fd;
     unsigned int size;
+    unsigned int nhashes;
+    char **hashes;
     unsigned int nchunks;
     Chunk *chunks;
+    // Digest index over every Merkle node, chunk j being node nhashes + j.
+    // A slot holds the lowest node with a digest and digest_next chains
+    // the later ones sharing it, in node order. Built once at load.
+    uint32_t *digest_slots;
+    uint32_t digest_mask;
+    uint32_t *digest_next;
+    // One bit per chunk, set only once the chunk's data hashed correctly.
+    // Bits are read without the lock; setting one is the commit point.
+    uint8_t *completed;
+    unsigned int completed_count;
+    pthread_mutex_t lock;
+    // Chunk data of this package, across all peers
+    TokenBucket upload_limit;
+    TokenBucket download_limit;
+    // Set while we hide what we hold and offer chunks one peer at a
+    // time, see superseed.c. Read without the lock.
+    int superseeding;
+    // Set by REMPACKAGE before the package is unpublished; from then on
+    // nothing may take a new lasting reference to it
+    int removed;
+    // Changed atomically. The registry holds one until the package is
+    // removed; a thread that may block while using it holds its own.
+    int refs;
 }Package;
 
+// Packages in the order they were added, for listing. Only the command
+// line thread touches these; everyone else looks packages up by
+// identifier, which takes no lock.
 extern Package **packages;
 extern int package_count;
 
+// No node, in the digest index
+#define PACKAGE_NO_NODE UINT32_MAX
+
+// Registry lookups go through an open-addressing table of fingerprints
+// kept at most half full, PACKAGE_INDEX_MIN slots to begin with
+#define PACKAGE_INDEX_MIN 16
+
 Package* load_package(const char *filename);
+int open_package_data(Package *pkg, int *created);
+void scan_package_data(Package *pkg);
+int chunk_is_complete(const Package *pkg, uint32_t index);
+int package_is_complete(const Package *pkg);
+int commit_chunk(Package *pkg, uint32_t index, const uint8_t digest[DIGEST_LEN]);
 void free_package(Package *pkg);
 void clear_rest_line(FILE *file, char buffer[]);
+uint64_t ident_fingerprint(const char *identifier);
 Package* find_package_by_identifier(const char *identifier);
 Chunk* find_chunk_by_hash(Package *pkg, const char *chunk_hash);
-void add_package_to_list(Package *pkg);
+int add_package_to_list(Package *pkg);
+int remove_package_from_list(Package *pkg);
+int package_is_removed(const Package *pkg);
+void retain_package(Package *pkg);
+void release_package(Package *pkg);
+Package* acquire_package_by_identifier(const char *identifier);
+int has_merkle_tree(const Package *pkg);
+const char* merkle_node_hash(const Package *pkg, uint32_t node);
+int find_merkle_node(const Package *pkg, const char *hash);
+int find_merkle_node_from(const Package *pkg, const char *hash, uint32_t first_chunk);
+void merkle_chunk_range(const Package *pkg, uint32_t node, uint32_t *first, uint32_t *count);
+int min_completed_nodes(const Package *pkg, uint32_t *nodes, int max);
+int hash_chunk_data(Package *pkg, uint32_t index, char hex[DIGEST_LEN * 2 + 1]);
+int verify_subtree(Package *pkg, uint32_t node);
+int hex_to_digest(const char *hex, uint8_t digest[DIGEST_LEN]);
+void digest_to_hex(const uint8_t digest[DIGEST_LEN], char hex[DIGEST_LEN * 2 + 1]);
 
 #endif // PACKAGE_H
 
@@ -3,119 +3,974 @@
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <poll.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <pthread.h>
+#include "config.h"
 #include "network.h"
 #include "peer.h"
+#include "epoch.h"
+#include "connector.h"
 
 
 
-Peer peers[2048];
+static Peer *peer_slots[PEER_TABLE_MAX];
+// One past the highest slot ever used, so scans stay short
+static int slot_limit = 0;
+static Peer *buckets[PEER_HASH_BUCKETS];
 int peer_count = 0;
 pthread_mutex_t peer_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-void* connect_to_peer(void* arg) {
-    Peer *new_peer = (Peer*)arg;
-
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("Socket creation error");
-        free(new_peer);
+// A peer starts with one reference owned by its reader thread
+Peer* create_peer(const char *ip, uint16_t port, int socket) {
+    Peer *peer = calloc(1, sizeof(Peer));
+    if (!peer) {
+        fprintf(stderr, "Failed to allocate memory for new peer.\n");
         return NULL;
     }
+    strncpy(peer->ip, ip, sizeof(peer->ip) - 1);
+    peer->port = port;
+    peer->socket = socket;
+    peer->refs = 1;
+    peer->slot = -1;
+    pthread_mutex_init(&peer->send_lock, NULL);
+    pthread_mutex_init(&peer->state_lock, NULL);
+    pthread_cond_init(&peer->credit_cond, NULL);
+    pthread_cond_init(&peer->job_cond, NULL);
+    peer->send_credit = PEER_FRAG_WINDOW;
+    peer->disk_wait = -1;
+    peer->req_window = PEER_WINDOW_INIT;
+    // Slots are handed out on first request
+    peer->am_choking = 1;
+    bucket_init(&peer->upload_limit, config.peer_upload_rate, config.rate_burst);
+    bucket_init(&peer->download_limit, config.peer_download_rate, config.rate_burst);
+    return peer;
+}
+
+// FNV-1a over the address and port
+static uint32_t peer_bucket(const char *ip, uint16_t port) {
+    uint32_t h = 2166136261u;
+    for (const char *c = ip; *c; c++) {
+        h = (h ^ (uint8_t)*c) * 16777619u;
+    }
+    h = (h ^ (port & 0xff)) * 16777619u;
+    h = (h ^ (port >> 8)) * 16777619u;
+    return h % PEER_HASH_BUCKETS;
+}
+
+// Takes a reference unless the last one is already gone
+static int try_retain(Peer *peer) {
+    int refs = __atomic_load_n(&peer->refs, __ATOMIC_ACQUIRE);
+    while (refs > 0) {
+        if (__atomic_compare_exchange_n(&peer->refs, &refs, refs + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Caller is inside an epoch critical section
+static Peer* lookup_peer(const char *ip, uint16_t port) {
+    Peer *peer = __atomic_load_n(&buckets[peer_bucket(ip, port)], __ATOMIC_ACQUIRE);
+    while (peer && (peer->port != port || strcmp(peer->ip, ip) != 0)) {
+        peer = __atomic_load_n(&peer->hash_next, __ATOMIC_ACQUIRE);
+    }
+    return peer;
+}
+
+// Publishes the peer in the table, which holds its own reference.
+// Refused once config.max_peers are connected or if a peer with the
+// same address and port already is.
+int add_peer(Peer *peer) {
+    pthread_mutex_lock(&peer_mutex);
+    if (peer->slot >= 0) {
+        pthread_mutex_unlock(&peer_mutex);
+        return 0;
+    }
+    if (lookup_peer(peer->ip, peer->port)) {
+        pthread_mutex_unlock(&peer_mutex);
+        fprintf(stderr, "Already connected to %s:%d.\n", peer->ip, peer->port);
+        return -1;
+    }
+    int slot = 0;
+    while (slot < PEER_TABLE_MAX && peer_slots[slot]) {
+        slot++;
+    }
+    if (peer_count >= config.max_peers || slot == PEER_TABLE_MAX) {
+        pthread_mutex_unlock(&peer_mutex);
+        fprintf(stderr, "Maximum number of peers reached.\n");
+        return -1;
+    }
+    __atomic_add_fetch(&peer->refs, 1, __ATOMIC_ACQ_REL);
+    peer->slot = slot;
+    uint32_t bucket = peer_bucket(peer->ip, peer->port);
+    peer->hash_next = buckets[bucket];
+    __atomic_store_n(&buckets[bucket], peer, __ATOMIC_RELEASE);
+    __atomic_store_n(&peer_slots[slot], peer, __ATOMIC_RELEASE);
+    if (slot >= slot_limit) {
+        __atomic_store_n(&slot_limit, slot + 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&peer_count, peer_count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&peer_mutex);
+    return 0;
+}
+
+// Unlinks the peer; its hash_next stays intact for readers still on it
+void remove_peer(Peer *peer) {
+    pthread_mutex_lock(&peer_mutex);
+    if (peer->slot < 0) {
+        pthread_mutex_unlock(&peer_mutex);
+        return;
+    }
+    Peer **link = &buckets[peer_bucket(peer->ip, peer->port)];
+    while (*link != peer) {
+        link = &(*link)->hash_next;
+    }
+    __atomic_store_n(link, peer->hash_next, __ATOMIC_RELEASE);
+    __atomic_store_n(&peer_slots[peer->slot], NULL, __ATOMIC_RELEASE);
+    peer->slot = -1;
+    __atomic_store_n(&peer_count, peer_count - 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&peer_mutex);
+    release_peer(peer);
+}
 
-    struct sockaddr_in serv_addr;
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(new_peer->port);
+void retain_peer(Peer *peer) {
+    __atomic_add_fetch(&peer->refs, 1, __ATOMIC_ACQ_REL);
+}
 
-    if (inet_pton(AF_INET, new_peer->ip, &serv_addr.sin_addr) <= 0) {
-        perror("Invalid address/ Address not supported");
-        close(sock);
-        free(new_peer);
+// Returns the peer with an extra reference, drop it with release_peer
+Peer* find_peer(const char *ip, uint16_t port) {
+    epoch_enter();
+    Peer *peer = lookup_peer(ip, port);
+    if (peer && !try_retain(peer)) {
+        peer = NULL;
+    }
+    epoch_exit();
+    return peer;
+}
+
+// Fills out with up to max peers in the table, each with a reference
+// to drop with release_peer. Returns how many.
+int snapshot_peers(Peer **out, int max) {
+    int count = 0;
+    epoch_enter();
+    int limit = __atomic_load_n(&slot_limit, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < limit && count < max; i++) {
+        Peer *peer = __atomic_load_n(&peer_slots[i], __ATOMIC_ACQUIRE);
+        if (peer && try_retain(peer)) {
+            out[count++] = peer;
+        }
+    }
+    epoch_exit();
+    return count;
+}
+
+// Whether we are connected to the node listening on ip:port, by either
+// the address we reach it at or the one it connected to us from
+int peer_known(const char *ip, uint16_t port) {
+    Peer *peer = find_peer(ip, port);
+    if (peer) {
+        release_peer(peer);
+        return 1;
+    }
+    int known = 0;
+    epoch_enter();
+    int limit = __atomic_load_n(&slot_limit, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < limit && !known; i++) {
+        peer = __atomic_load_n(&peer_slots[i], __ATOMIC_ACQUIRE);
+        known = peer && __atomic_load_n(&peer->listen_port, __ATOMIC_ACQUIRE) == port && strcmp(peer->ip, ip) == 0;
+    }
+    epoch_exit();
+    return known;
+}
+
+static void destroy_peer(void *arg) {
+    Peer *peer = (Peer *)arg;
+    if (peer->socket >= 0) {
+        close(peer->socket);
+    }
+    pthread_mutex_destroy(&peer->send_lock);
+    pthread_mutex_destroy(&peer->state_lock);
+    pthread_cond_destroy(&peer->credit_cond);
+    pthread_cond_destroy(&peer->job_cond);
+    for (int i = 0; i < PEER_MAX_HANDLES; i++) {
+        free(peer->rx_have[i]);
+        free(peer->tx_have[i]);
+    }
+    while (peer->jobs) {
+        UploadJob *job = peer->jobs;
+        peer->jobs = job->next;
+        free(job);
+    }
+    while (peer->notices) {
+        PeerNotice *notice = peer->notices;
+        peer->notices = notice->next;
+        free(notice);
+    }
+    free(peer);
+}
+
+void release_peer(Peer *peer) {
+    if (__atomic_sub_fetch(&peer->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        epoch_retire(destroy_peer, peer);
+    }
+}
+
+// Frames from several threads may share a socket, keep them whole
+int peer_send(Peer *peer, const struct btide_packet *packet) {
+    pthread_mutex_lock(&peer->send_lock);
+    int rc = send_packet(peer->socket, packet);
+    pthread_mutex_unlock(&peer->send_lock);
+    return rc;
+}
+
+// Sends only if that cannot block: no other frame is going out and the
+// socket has room. Returns 1 if the frame was not sent.
+int peer_try_send(Peer *peer, const struct btide_packet *packet) {
+    if (pthread_mutex_trylock(&peer->send_lock) != 0) {
+        return 1;
+    }
+    struct pollfd pfd = { peer->socket, POLLOUT, 0 };
+    int rc = 1;
+    if (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT)) {
+        rc = send_packet(peer->socket, packet);
+    }
+    pthread_mutex_unlock(&peer->send_lock);
+    return rc;
+}
+
+// Queues a short control frame for the upload thread and returns at
+// once. Returns -1 if it was dropped.
+int peer_post(Peer *peer, const struct btide_packet *packet) {
+    if (packet->len > PEER_NOTICE_LEN) {
+        return -1;
+    }
+    PeerNotice *notice = malloc(sizeof(PeerNotice));
+    if (!notice) {
+        fprintf(stderr, "Failed to allocate peer notice\n");
+        return -1;
+    }
+    notice->msg_code = packet->msg_code;
+    notice->len = packet->len;
+    memcpy(notice->data, packet->pl.data, packet->len);
+    notice->next = NULL;
+
+    pthread_mutex_lock(&peer->state_lock);
+    if (peer->closing || peer->notice_count >= PEER_NOTICES_MAX) {
+        pthread_mutex_unlock(&peer->state_lock);
+        free(notice);
+        return -1;
+    }
+    if (peer->notices_tail) {
+        peer->notices_tail->next = notice;
+    } else {
+        peer->notices = notice;
+    }
+    peer->notices_tail = notice;
+    peer->notice_count++;
+    pthread_cond_signal(&peer->job_cond);
+    pthread_cond_signal(&peer->credit_cond);
+    pthread_mutex_unlock(&peer->state_lock);
+    return 0;
+}
+
+// Sends what peer_post queued. Only the upload thread calls it, while
+// waiting for work or credit.
+static void peer_send_notices(Peer *peer) {
+    pthread_mutex_lock(&peer->state_lock);
+    PeerNotice *notice = peer->notices;
+    peer->notices = NULL;
+    peer->notices_tail = NULL;
+    peer->notice_count = 0;
+    pthread_mutex_unlock(&peer->state_lock);
+
+    struct btide_packet frame;
+    while (notice) {
+        PeerNotice *next = notice->next;
+        frame.msg_code = notice->msg_code;
+        frame.error = PKT_ERR_NONE;
+        frame.len = notice->len;
+        memcpy(frame.pl.data, notice->data, notice->len);
+        peer_send(peer, &frame);
+        free(notice);
+        notice = next;
+    }
+}
+
+// The package bound to handle, one we bound if ours is set, with a
+// reference taken so the caller may block while using it. NULL if the
+// handle is not bound.
+Package* peer_acquire_package(Peer *peer, uint16_t handle, int ours) {
+    if (handle >= PEER_MAX_HANDLES) {
         return NULL;
     }
+    pthread_mutex_lock(&peer->state_lock);
+    Package *pkg = ours ? peer->tx_handles[handle] : peer->rx_handles[handle];
+    // Still bound, so peer_forget_package has not come by and the
+    // registry still holds it
+    if (pkg) {
+        retain_package(pkg);
+    }
+    pthread_mutex_unlock(&peer->state_lock);
+    return pkg;
+}
+
+// Returns the handle for pkg on this connection, sending a BND the
+// first time the package is used. The BND goes out under send_lock so
+// the remote always sees it before any REQ carrying the handle.
+uint16_t peer_bind_package(Peer *peer, Package *pkg) {
+    pthread_mutex_lock(&peer->send_lock);
+    for (int i = 0; i < peer->tx_count; i++) {
+        if (peer->tx_handles[i] == pkg) {
+            pthread_mutex_unlock(&peer->send_lock);
+            return (uint16_t)i;
+        }
+    }
+    if (peer->tx_count >= PEER_MAX_HANDLES) {
+        pthread_mutex_unlock(&peer->send_lock);
+        fprintf(stderr, "No free package handles on this connection\n");
+        return PEER_NO_HANDLE;
+    }
+
+    // Published before the BND leaves, as the answer can beat us back.
+    // Checked under state_lock so peer_forget_package cannot miss it.
+    uint16_t handle = (uint16_t)peer->tx_count;
+    pthread_mutex_lock(&peer->state_lock);
+    if (package_is_removed(pkg)) {
+        pthread_mutex_unlock(&peer->state_lock);
+        pthread_mutex_unlock(&peer->send_lock);
+        return PEER_NO_HANDLE;
+    }
+    peer->tx_handles[handle] = pkg;
+    peer->tx_count++;
+    pthread_mutex_unlock(&peer->state_lock);
+
+    struct btide_packet bnd;
+    encode_bnd_packet(handle, pkg->ident, &bnd);
+    if (send_packet(peer->socket, &bnd) < 0) {
+        // The connection is going away, the handle is never reused
+        pthread_mutex_unlock(&peer->send_lock);
+        return PEER_NO_HANDLE;
+    }
+    pthread_mutex_unlock(&peer->send_lock);
 
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("Connection failed");
-        close(sock);
-        free(new_peer);
+    // Tell the remote what we hold; it answers the BND with its own
+    send_bitfield(peer, handle, HANDLE_SENDER, pkg);
+    return handle;
+}
+
+// Availability map for a handle, allocated on first use. `ours` picks
+// handles we bound (tx) over handles the remote bound (rx). Caller holds
+// state_lock; NULL if the handle is not bound.
+uint8_t* peer_have_map(Peer *peer, uint16_t handle, int ours) {
+    if (handle >= PEER_MAX_HANDLES) {
+        return NULL;
+    }
+    Package *pkg = ours ? peer->tx_handles[handle] : peer->rx_handles[handle];
+    uint8_t **map = ours ? &peer->tx_have[handle] : &peer->rx_have[handle];
+    if (!pkg) {
         return NULL;
     }
+    if (!*map) {
+        *map = calloc((pkg->nchunks + 7) / 8 + 1, 1);
+    }
+    return *map;
+}
 
-    new_peer->socket = sock;
+// Finds a handle naming pkg on this connection, preferring our own
+int peer_handle_for(Peer *peer, Package *pkg, int *ours) {
+    int handle = -1;
+    pthread_mutex_lock(&peer->state_lock);
+    for (int i = 0; i < peer->tx_count && handle < 0; i++) {
+        if (peer->tx_handles[i] == pkg) {
+            *ours = 1;
+            handle = i;
+        }
+    }
+    for (int i = 0; i < PEER_MAX_HANDLES && handle < 0; i++) {
+        if (peer->rx_handles[i] == pkg) {
+            *ours = 0;
+            handle = i;
+        }
+    }
+    pthread_mutex_unlock(&peer->state_lock);
+    return handle;
+}
 
-    struct btide_packet acp_packet = { PKT_MSG_ACP, 0, {{0}} };
-    send_packet(sock, &acp_packet);
+// Copies what the remote has told us it holds of pkg into out. When
+// both sides bound the package its notices may arrive under either
+// handle, so the maps are merged. Returns 0 if it has not sent a
+// bitfield for the package yet.
+int peer_copy_have(Peer *peer, Package *pkg, uint8_t *out) {
+    size_t len = (pkg->nchunks + 7) / 8;
+    int found = 0;
+    memset(out, 0, len);
+    pthread_mutex_lock(&peer->state_lock);
+    for (int i = 0; i < PEER_MAX_HANDLES; i++) {
+        const uint8_t *maps[2] = {
+            peer->tx_handles[i] == pkg ? peer->tx_have[i] : NULL,
+            peer->rx_handles[i] == pkg ? peer->rx_have[i] : NULL,
+        };
+        for (int m = 0; m < 2; m++) {
+            if (!maps[m]) {
+                continue;
+            }
+            for (size_t b = 0; b < len; b++) {
+                out[b] |= maps[m][b];
+            }
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&peer->state_lock);
+    return found;
+}
 
-    struct btide_packet ack_packet;
-    receive_packet(sock, &ack_packet);
-    if (ack_packet.msg_code == PKT_MSG_ACK) {
-        pthread_mutex_lock(&peer_mutex);
-        peers[peer_count++] = *new_peer;
-        pthread_mutex_unlock(&peer_mutex);
-        printf("Connection established with peer.\n");
+int peer_request_window(Peer *peer) {
+    pthread_mutex_lock(&peer->state_lock);
+    int window = (int)peer->req_window;
+    pthread_mutex_unlock(&peer->state_lock);
+    return window;
+}
+
+// A chunk requested from the peer arrived and verified
+void peer_request_done(Peer *peer, uint32_t bytes, uint64_t latency_ms, uint64_t now_ms) {
+    pthread_mutex_lock(&peer->state_lock);
+    double sample = (double)latency_ms;
+    if (peer->req_latency_ms == 0) {
+        peer->req_latency_ms = sample;
+        peer->req_min_latency_ms = sample;
     } else {
-        printf("ACK not received.\n");
-        close(sock);
+        peer->req_latency_ms += (sample - peer->req_latency_ms) / 8;
+        if (sample < peer->req_min_latency_ms) {
+            peer->req_min_latency_ms = sample;
+        }
     }
 
-    free(new_peer);
-    return NULL;
+    if (peer->rate_start_ms == 0) {
+        peer->rate_start_ms = now_ms;
+    }
+    peer->rate_bytes += bytes;
+    // The first estimate comes early so short transfers get one too
+    uint64_t elapsed = now_ms - peer->rate_start_ms;
+    if (elapsed >= PEER_RATE_PERIOD_MS || (peer->rx_rate == 0 && elapsed >= PEER_RATE_PERIOD_MS / 10)) {
+        double rate = (double)peer->rate_bytes * 1000 / (double)elapsed;
+        peer->rx_rate = peer->rx_rate == 0 ? rate : peer->rx_rate + (rate - peer->rx_rate) / 4;
+        peer->rate_bytes = 0;
+        peer->rate_start_ms = now_ms;
+    }
+
+    // Additive increase, up to what the link has shown it can carry
+    double ceiling = PEER_WINDOW_MAX;
+    if (peer->rx_rate > 0 && bytes > 0) {
+        double in_flight = peer->rx_rate * (peer->req_min_latency_ms + 1) / 1000 / bytes;
+        if (2 * in_flight + PEER_WINDOW_INIT < ceiling) {
+            ceiling = 2 * in_flight + PEER_WINDOW_INIT;
+        }
+    }
+    if (peer->req_window < ceiling) {
+        peer->req_window += 1 / peer->req_window;
+    }
+    pthread_mutex_unlock(&peer->state_lock);
 }
 
-void connect_peer(const char *ip, uint16_t port) {
-    if (peer_count >= 2048) {
-        fprintf(stderr, "Maximum number of peers reached.\n");
-        return;
+// Multiplicative decrease, at most once per round trip so a burst of
+// expiries from one stall counts once
+void peer_request_timeout(Peer *peer, uint64_t now_ms) {
+    pthread_mutex_lock(&peer->state_lock);
+    if (now_ms - peer->last_cut_ms >= (uint64_t)peer->req_latency_ms) {
+        peer->req_window /= 2;
+        if (peer->req_window < PEER_WINDOW_MIN) {
+            peer->req_window = PEER_WINDOW_MIN;
+        }
+        peer->last_cut_ms = now_ms;
     }
+    pthread_mutex_unlock(&peer->state_lock);
+}
 
-    Peer *new_peer = malloc(sizeof(Peer));
-    if (!new_peer) {
-        fprintf(stderr, "Failed to allocate memory for new peer.\n");
-        return;
+// Counts a ping about to go out. Returns how many earlier ones are
+// still unanswered, in which case the caller gives up instead.
+int peer_heartbeat_due(Peer *peer) {
+    pthread_mutex_lock(&peer->state_lock);
+    int missed = peer->pings_unanswered++;
+    pthread_mutex_unlock(&peer->state_lock);
+    return missed;
+}
+
+// Smooths the round trip as TCP does: the mean moves by 1/8 of the
+// error and the deviation by 1/4
+void peer_heartbeat_answered(Peer *peer, uint64_t rtt_ms) {
+    double sample = (double)rtt_ms;
+    pthread_mutex_lock(&peer->state_lock);
+    peer->pings_unanswered = 0;
+    if (peer->ping_rtt_ms == 0) {
+        peer->ping_rtt_ms = sample;
+        peer->ping_jitter_ms = sample / 2;
+    } else {
+        double error = sample - peer->ping_rtt_ms;
+        peer->ping_jitter_ms += ((error < 0 ? -error : error) - peer->ping_jitter_ms) / 4;
+        peer->ping_rtt_ms += error / 8;
     }
+    pthread_mutex_unlock(&peer->state_lock);
+}
 
-    strncpy(new_peer->ip, ip, 16);
-    new_peer->port = port;
-    new_peer->socket = -1;
+int peer_is_interested(Peer *peer, uint64_t now) {
+    pthread_mutex_lock(&peer->state_lock);
+    int interested = peer->interested_ms && now - peer->interested_ms < PEER_INTEREST_MS;
+    pthread_mutex_unlock(&peer->state_lock);
+    return interested;
+}
 
-    pthread_t thread_id;
-    pthread_create(&thread_id, NULL, connect_to_peer, new_peer);
-    pthread_detach(thread_id);
+// Interested peers we are uploading to
+static int slots_in_use(uint64_t now) {
+    int used = 0;
+    epoch_enter();
+    int limit = __atomic_load_n(&slot_limit, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < limit; i++) {
+        Peer *peer = __atomic_load_n(&peer_slots[i], __ATOMIC_ACQUIRE);
+        if (!peer) {
+            continue;
+        }
+        pthread_mutex_lock(&peer->state_lock);
+        if (!peer->am_choking && peer->interested_ms && now - peer->interested_ms < PEER_INTEREST_MS) {
+            used++;
+        }
+        pthread_mutex_unlock(&peer->state_lock);
+    }
+    epoch_exit();
+    return used;
 }
 
-void disconnect_peer(const char *ip, uint16_t port) {
-    pthread_mutex_lock(&peer_mutex);
-    for (int i = 0; i < peer_count; i++) {
-        if (strcmp(peers[i].ip, ip) == 0 && peers[i].port == port) {
-            struct btide_packet dsn_packet = { PKT_MSG_DSN, 0, {{0}} };
-            send_packet(peers[i].socket, &dsn_packet);
-            close(peers[i].socket);
-
-            for (int j = i; j < peer_count - 1; j++) {
-                peers[j] = peers[j + 1];
+// Called for every request and INT. A choked peer takes a free slot straight
+// away instead of waiting for the next choke round; otherwise its
+// request is refused. notify is set to the message the peer should get,
+// or 0. Returns 1 if the request may be served.
+int peer_request_slot(Peer *peer, int slots, uint16_t *notify) {
+    uint64_t now = monotonic_ms();
+    *notify = 0;
+    pthread_mutex_lock(&peer->state_lock);
+    peer->interested_ms = now;
+    int choked = peer->am_choking;
+    pthread_mutex_unlock(&peer->state_lock);
+    if (!choked) {
+        return 1;
+    }
+
+    int used = slots_in_use(now);
+    pthread_mutex_lock(&peer->state_lock);
+    if (peer->am_choking && used < slots) {
+        peer->am_choking = 0;
+        peer->choke_sent = 0;
+        *notify = PKT_MSG_UNC;
+    } else if (peer->am_choking && !peer->choke_sent) {
+        peer->choke_sent = 1;
+        *notify = PKT_MSG_CHK;
+    }
+    int granted = !peer->am_choking;
+    pthread_mutex_unlock(&peer->state_lock);
+    return granted;
+}
+
+// Applies a choke round's decision. An idle peer is choked without
+// telling it, so its next request can still take a free slot. Returns
+// 1 if the state changed.
+int peer_set_choking(Peer *peer, int choke, uint16_t *notify) {
+    uint64_t now = monotonic_ms();
+    *notify = 0;
+    pthread_mutex_lock(&peer->state_lock);
+    int changed = peer->am_choking != choke;
+    int interested = peer->interested_ms && now - peer->interested_ms < PEER_INTEREST_MS;
+    if (choke && interested && !peer->choke_sent) {
+        peer->choke_sent = 1;
+        *notify = PKT_MSG_CHK;
+    } else if (!choke && changed) {
+        peer->choke_sent = 0;
+        *notify = PKT_MSG_UNC;
+    }
+    peer->am_choking = choke;
+    pthread_mutex_unlock(&peer->state_lock);
+    return changed;
+}
+
+int peer_is_choking_us(Peer *peer) {
+    pthread_mutex_lock(&peer->state_lock);
+    int choking = peer->remote_choking;
+    pthread_mutex_unlock(&peer->state_lock);
+    return choking;
+}
+
+void peer_set_choking_us(Peer *peer, int choking) {
+    pthread_mutex_lock(&peer->state_lock);
+    peer->remote_choking = choking;
+    peer->interest_sent_ms = 0;
+    pthread_mutex_unlock(&peer->state_lock);
+}
+
+// Whether to remind a peer that chokes us that we still want data,
+// which keeps us in the running for its slots
+int peer_interest_due(Peer *peer, uint64_t now) {
+    pthread_mutex_lock(&peer->state_lock);
+    int due = peer->remote_choking && now - peer->interest_sent_ms >= PEER_INTEREST_MS / 2;
+    if (due) {
+        peer->interest_sent_ms = now;
+    }
+    pthread_mutex_unlock(&peer->state_lock);
+    return due;
+}
+
+// Forgets every queued upload, once the peer has been choked
+void peer_drop_uploads(Peer *peer) {
+    pthread_mutex_lock(&peer->state_lock);
+    while (peer->jobs) {
+        UploadJob *job = peer->jobs;
+        peer->jobs = job->next;
+        free(job);
+    }
+    peer->jobs_tail = NULL;
+    pthread_mutex_unlock(&peer->state_lock);
+}
+
+// Blocks until the receiver has room for another data frame, sending
+// notices while it waits, as they take no credit. Returns -1 once the
+// connection is closing.
+int peer_take_credit(Peer *peer) {
+    pthread_mutex_lock(&peer->state_lock);
+    while ((peer->send_credit <= 0 || peer->notices) && !peer->closing) {
+        if (peer->notices) {
+            pthread_mutex_unlock(&peer->state_lock);
+            peer_send_notices(peer);
+            pthread_mutex_lock(&peer->state_lock);
+        } else {
+            pthread_cond_wait(&peer->credit_cond, &peer->state_lock);
+        }
+    }
+    int rc = peer->closing ? -1 : 0;
+    if (rc == 0) {
+        peer->send_credit--;
+    }
+    pthread_mutex_unlock(&peer->state_lock);
+    return rc;
+}
+
+void peer_grant_credit(Peer *peer, int credit) {
+    pthread_mutex_lock(&peer->state_lock);
+    peer->send_credit += credit;
+    pthread_cond_signal(&peer->credit_cond);
+    pthread_mutex_unlock(&peer->state_lock);
+}
+
+int peer_queue_upload(Peer *peer, const UploadJob *job) {
+    UploadJob *copy = malloc(sizeof(UploadJob));
+    if (!copy) {
+        fprintf(stderr, "Failed to allocate upload job\n");
+        return -1;
+    }
+    *copy = *job;
+    copy->next = NULL;
+
+    pthread_mutex_lock(&peer->state_lock);
+    if (package_is_removed(copy->pkg)) {
+        pthread_mutex_unlock(&peer->state_lock);
+        free(copy);
+        return -1;
+    }
+    if (peer->jobs_tail) {
+        peer->jobs_tail->next = copy;
+    } else {
+        peer->jobs = copy;
+    }
+    peer->jobs_tail = copy;
+    pthread_cond_signal(&peer->job_cond);
+    pthread_mutex_unlock(&peer->state_lock);
+    return 0;
+}
+
+// Waits for the next queued job, sending any notices posted meanwhile,
+// NULL once the connection is closing. The job comes back holding a
+// reference to its package, taken before the lock drops so a removal
+// that no longer finds it queued cannot free the package under it.
+UploadJob* peer_next_upload(Peer *peer) {
+    pthread_mutex_lock(&peer->state_lock);
+    while ((!peer->jobs || peer->notices) && !peer->closing) {
+        if (peer->notices) {
+            pthread_mutex_unlock(&peer->state_lock);
+            peer_send_notices(peer);
+            pthread_mutex_lock(&peer->state_lock);
+        } else {
+            pthread_cond_wait(&peer->job_cond, &peer->state_lock);
+        }
+    }
+    UploadJob *job = NULL;
+    if (!peer->closing) {
+        job = peer->jobs;
+        peer->jobs = job->next;
+        if (!peer->jobs) {
+            peer->jobs_tail = NULL;
+        }
+        peer->job_active = job;
+        // Queued means peer_forget_package has not come by, so the
+        // registry still holds it
+        retain_package(job->pkg);
+    }
+    pthread_mutex_unlock(&peer->state_lock);
+    return job;
+}
+
+// Frees a job returned by peer_next_upload once it has been served
+void peer_finish_upload(Peer *peer, UploadJob *job) {
+    pthread_mutex_lock(&peer->state_lock);
+    peer->job_active = NULL;
+    pthread_mutex_unlock(&peer->state_lock);
+    release_package(job->pkg);
+    free(job);
+}
+
+// Whether the remote has withdrawn the chunk being sent
+int peer_upload_cancelled(Peer *peer) {
+    pthread_mutex_lock(&peer->state_lock);
+    int cancelled = peer->job_active && peer->job_active->cancelled;
+    pthread_mutex_unlock(&peer->state_lock);
+    return cancelled;
+}
+
+// Drops a chunk the remote no longer wants: a queued job for just that
+// chunk, or the end of a queued run, is removed, and one already being
+// sent stops at its next frame. A chunk in the middle of a run stays.
+void peer_cancel_upload(Peer *peer, Package *pkg, uint32_t index) {
+    pthread_mutex_lock(&peer->state_lock);
+    UploadJob *active = peer->job_active;
+    if (active && active->pkg == pkg && active->count == 1 && active->first == index) {
+        active->cancelled = 1;
+    }
+    UploadJob **link = &peer->jobs;
+    UploadJob *prev = NULL;
+    while (*link) {
+        UploadJob *job = *link;
+        if (job->pkg == pkg && job->count == 1 && job->first == index) {
+            *link = job->next;
+            if (peer->jobs_tail == job) {
+                peer->jobs_tail = prev;
             }
-            peer_count--;
-            printf("Disconnected from peer.\n");
-            pthread_mutex_unlock(&peer_mutex);
-            return;
+            free(job);
+            continue;
         }
+        if (job->pkg == pkg && job->len == 0 && job->count > 1) {
+            if (job->first == index) {
+                job->first++;
+                job->count--;
+                job->offset = pkg->chunks[job->first].offset;
+            } else if (job->first + job->count - 1 == index) {
+                job->count--;
+            }
+        }
+        prev = job;
+        link = &job->next;
     }
-    pthread_mutex_unlock(&peer_mutex);
-    printf("Unknown peer, not connected.\n");
+    pthread_mutex_unlock(&peer->state_lock);
+}
+
+// Drops every reference a connection keeps to a removed package: its
+// handles, availability, queued uploads and subtree fetches. Receives
+// belong to the reader thread and are left alone; one naming a freed
+// package can only match a new package at the same address, and then
+// fails verification.
+void peer_forget_package(Package *pkg) {
+    Peer *snapshot[PEER_TABLE_MAX];
+    int count = snapshot_peers(snapshot, PEER_TABLE_MAX);
+
+    for (int p = 0; p < count; p++) {
+        Peer *peer = snapshot[p];
+        pthread_mutex_lock(&peer->state_lock);
+        for (int i = 0; i < PEER_MAX_HANDLES; i++) {
+            if (peer->rx_handles[i] == pkg) {
+                peer->rx_handles[i] = NULL;
+                free(peer->rx_have[i]);
+                peer->rx_have[i] = NULL;
+            }
+            if (peer->tx_handles[i] == pkg) {
+                peer->tx_handles[i] = NULL;
+                free(peer->tx_have[i]);
+                peer->tx_have[i] = NULL;
+            }
+        }
+        UploadJob **link = &peer->jobs;
+        peer->jobs_tail = NULL;
+        while (*link) {
+            UploadJob *job = *link;
+            if (job->pkg == pkg) {
+                *link = job->next;
+                free(job);
+            } else {
+                peer->jobs_tail = job;
+                link = &job->next;
+            }
+        }
+        for (int i = peer->subtree_count - 1; i >= 0; i--) {
+            if (peer->subtrees[i].pkg == pkg) {
+                peer->subtrees[i] = peer->subtrees[--peer->subtree_count];
+            }
+        }
+        pthread_mutex_unlock(&peer->state_lock);
+        release_peer(peer);
+    }
+}
+
+// Wakes anything blocked on the connection so it can wind down
+void peer_close(Peer *peer) {
+    pthread_mutex_lock(&peer->state_lock);
+    peer->closing = 1;
+    pthread_cond_broadcast(&peer->credit_cond);
+    pthread_cond_broadcast(&peer->job_cond);
+    pthread_mutex_unlock(&peer->state_lock);
+}
+
+// Feeds a received fragment into the running hash for its chunk. Hashing
+// only works on an in-order stream that started at the chunk's first
+// byte; anything else is written but left unhashed. Returns 1 and fills
+// digest when the fragment completes a hashed chunk.
+int peer_receive_data(Peer *peer, Package *pkg, uint32_t chunk_index, uint32_t offset,
+    const char *data, uint32_t len, uint8_t digest[DIGEST_LEN]) {
+    Chunk *chunk = &pkg->chunks[chunk_index];
+    ChunkReceive *recv = NULL;
+    int slot = -1;
+
+    for (int i = 0; i < peer->receive_count; i++) {
+        if (peer->receives[i].pkg == pkg && peer->receives[i].chunk_index == chunk_index) {
+            recv = &peer->receives[i];
+            slot = i;
+            break;
+        }
+    }
+
+    if (offset == chunk->offset) {
+        if (!recv) {
+            if (peer->receive_count >= PEER_MAX_RECEIVES) {
+                return 0;
+            }
+            slot = peer->receive_count++;
+            recv = &peer->receives[slot];
+        }
+        recv->pkg = pkg;
+        recv->chunk_index = chunk_index;
+        recv->next_offset = chunk->offset;
+        sha256_compute_data_init(&recv->sha);
+    }
+    if (!recv) {
+        return 0;
+    }
+    if (offset != recv->next_offset) {
+        // Out of order, the running hash is useless now
+        peer->receives[slot] = peer->receives[--peer->receive_count];
+        return 0;
+    }
+
+    sha256_update(&recv->sha, (void *)data, len);
+    recv->next_offset += len;
+    if (recv->next_offset < chunk->offset + chunk->size) {
+        return 0;
+    }
+
+    sha256_finalize(&recv->sha, digest);
+    sha256_output(&recv->sha, digest);
+    peer->receives[slot] = peer->receives[--peer->receive_count];
+    return 1;
+}
+
+// Remembers a subtree fetch so the response stream can be checked
+// against the Merkle node once every chunk under it has arrived
+int peer_track_subtree(Peer *peer, Package *pkg, uint32_t node) {
+    pthread_mutex_lock(&peer->state_lock);
+    if (peer->subtree_count >= PEER_MAX_SUBTREES || package_is_removed(pkg)) {
+        pthread_mutex_unlock(&peer->state_lock);
+        return -1;
+    }
+    SubtreeFetch *fetch = &peer->subtrees[peer->subtree_count++];
+    fetch->pkg = pkg;
+    fetch->node = node;
+    merkle_chunk_range(pkg, node, &fetch->first, &fetch->count);
+    pthread_mutex_unlock(&peer->state_lock);
+    return 0;
+}
+
+// Called as a chunk commits. Returns 1 and sets node when every chunk
+// of a tracked subtree is now complete; it is then no longer tracked.
+int peer_subtree_progress(Peer *peer, Package *pkg, uint32_t chunk_index, uint32_t *node) {
+    int done = 0;
+    pthread_mutex_lock(&peer->state_lock);
+    for (int i = 0; i < peer->subtree_count; i++) {
+        SubtreeFetch *fetch = &peer->subtrees[i];
+        if (fetch->pkg != pkg || chunk_index < fetch->first || chunk_index >= fetch->first + fetch->count) {
+            continue;
+        }
+        uint32_t have = 0;
+        while (have < fetch->count && chunk_is_complete(pkg, fetch->first + have)) {
+            have++;
+        }
+        if (have == fetch->count) {
+            *node = fetch->node;
+            peer->subtrees[i] = peer->subtrees[--peer->subtree_count];
+            done = 1;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&peer->state_lock);
+    return done;
+}
+
+void connect_peer(const char *ip, uint16_t port) {
+    if (__atomic_load_n(&peer_count, __ATOMIC_ACQUIRE) >= config.max_peers) {
+        fprintf(stderr, "Maximum number of peers reached.\n");
+        return;
+    }
+    struct in_addr addr;
+    if (inet_pton(AF_INET, ip, &addr) <= 0) {
+        printf("Invalid address/ Address not supported\n");
+        return;
+    }
+    Peer *peer = find_peer(ip, port);
+    if (peer) {
+        release_peer(peer);
+        printf("Already connected to peer.\n");
+        return;
+    }
+    if (queue_connect(ip, port, NULL, NULL) < 0) {
+        printf("Already connecting to peer.\n");
+    }
+}
+
+void disconnect_peer(const char *ip, uint16_t port) {
+    Peer *peer = find_peer(ip, port);
+    if (!peer) {
+        printf("Unknown peer, not connected.\n");
+        return;
+    }
+
+    struct btide_packet dsn_packet = { PKT_MSG_DSN, 0, 0, {{0}} };
+    peer_send(peer, &dsn_packet);
+    // The reader thread sees EOF and tears the session down
+    shutdown(peer->socket, SHUT_RDWR);
+    remove_peer(peer);
+    release_peer(peer);
+    printf("Disconnected from peer.\n");
 }
 
 void list_peers() {
-    pthread_mutex_lock(&peer_mutex);
-    if (peer_count == 0) {
+    Peer *snapshot[PEER_TABLE_MAX];
+    int count = snapshot_peers(snapshot, PEER_TABLE_MAX);
+    if (count == 0) {
         printf("Not connected to any peers\n");
     } else {
         printf("Connected to:\n");
-        for (int i = 0; i < peer_count; i++) {
-            printf("%d. %s:%d\n", i + 1, peers[i].ip, peers[i].port);
-        }
     }
-    pthread_mutex_unlock(&peer_mutex);
+    for (int i = 0; i < count; i++) {
+        Peer *peer = snapshot[i];
+        pthread_mutex_lock(&peer->state_lock);
+        printf("%d. %s:%d window %.1f, %.1f KB/s, latency %.0f ms, rtt %.1f ms, jitter %.1f ms%s%s\n",
+            i + 1, peer->ip, peer->port, peer->req_window, peer->rx_rate / 1024, peer->req_latency_ms,
+            peer->ping_rtt_ms, peer->ping_jitter_ms,
+            peer->am_choking ? ", choked" : "", peer->remote_choking ? ", choking us" : "");
+        pthread_mutex_unlock(&peer->state_lock);
+        release_peer(peer);
+    }
 }
-
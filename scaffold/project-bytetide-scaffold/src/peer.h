@@ -2,21 +2,223 @@
 #define PEER_H
 
 #include <pthread.h>
+#include <stdint.h>
+#include "package.h"
+#include "crypt/sha256.h"
+#include "ratelimit.h"
+
+// Package handles are negotiated once per connection with a BND packet,
+// after which REQ/RES refer to a package by its handle
+#define PEER_MAX_HANDLES 256
+#define PEER_NO_HANDLE 0xffff
+
+// Peers sit in stable slots, at most config.max_peers of them, and are
+// found by address and port through chained hash buckets. Readers walk
+// both inside an epoch critical section without a lock; writers hold
+// peer_mutex. A peer is retired to the epoch reclaimer when its last
+// reference goes, so a reader may still be looking at it.
+#define PEER_TABLE_MAX 2048
+#define PEER_HASH_BUCKETS 4096
+
+// Outstanding subtree fetches we verify once their last chunk commits
+#define PEER_MAX_SUBTREES 16
+
+// RES data frames a sender may have in flight before the receiver
+// hands back credit with a WND packet
+#define PEER_FRAG_WINDOW 64
+// Chunks being reassembled at once on one connection
+#define PEER_MAX_RECEIVES 8
+
+// Chunk requests kept outstanding on a peer grow by one per round trip
+// while chunks keep arriving and halve on a timeout. Growth stops at
+// twice the chunks the measured rate and base latency keep in flight.
+#define PEER_WINDOW_INIT 4
+#define PEER_WINDOW_MIN 1
+#define PEER_WINDOW_MAX 64
+// Period over which received bytes are folded into the rate estimate
+#define PEER_RATE_PERIOD_MS 500
+
+// Upload slots are reassigned every PEER_CHOKE_INTERVAL seconds, the
+// optimistic one every PEER_OPTIMISTIC_ROUNDS rounds. A peer counts as
+// interested for PEER_INTEREST_MS after its last request or INT, and a
+// choked peer repeats its INT twice as often so it never lapses.
+#define PEER_CHOKE_INTERVAL 10
+#define PEER_OPTIMISTIC_ROUNDS 3
+#define PEER_INTEREST_MS 4000
+
+// Control frames other threads leave for the connection's upload
+// thread to send, so none of them waits on this peer's socket. Their
+// payloads are short; past PEER_NOTICES_MAX queued, new ones are lost.
+#define PEER_NOTICE_LEN 16
+#define PEER_NOTICES_MAX 1024
+
+struct btide_packet;
+
+// Queued work for the connection's upload thread: serve chunks
+// [first, first + count), starting at absolute file offset `offset`
+// within the first chunk and stopping after `len` bytes (0 = all)
+typedef struct UploadJob {
+    Package *pkg;
+    uint16_t handle;
+    uint32_t first;
+    uint32_t count;
+    uint32_t offset;
+    uint32_t len;
+    // Set under state_lock when the remote withdraws the chunk while
+    // it is being sent
+    int cancelled;
+    struct UploadJob *next;
+} UploadJob;
+
+typedef struct PeerNotice {
+    uint16_t msg_code;
+    uint32_t len;
+    uint8_t data[PEER_NOTICE_LEN];
+    struct PeerNotice *next;
+} PeerNotice;
+
+// A chunk arriving in order from its first byte, hashed as it lands
+typedef struct {
+    Package *pkg;
+    uint32_t chunk_index;
+    uint32_t next_offset;
+    struct sha256_compute_data sha;
+} ChunkReceive;
 
 typedef struct {
+    Package *pkg;
+    uint32_t node;
+    uint32_t first;
+    uint32_t count;
+} SubtreeFetch;
+
+typedef struct Peer {
     char ip[16];
     uint16_t port;
     int socket;
+    // Changed atomically; the table holds one while the peer is in it
+    int refs;
+    // Slot in the peer table, -1 when not in it, and the next peer in
+    // the same hash bucket
+    int slot;
+    struct Peer *hash_next;
+    // Port the peer accepts connections on, 0 until it tells us in a
+    // PEX frame unless we dialled it. Read without a lock.
+    uint16_t listen_port;
+    // When its last PEX frame was acted on (reader only), and how many
+    // dials to peers it named are still in flight (atomic)
+    uint64_t pex_at_ms;
+    int pex_dials;
+    pthread_mutex_t send_lock;
+    // Handles the remote side bound, used to serve its requests
+    Package *rx_handles[PEER_MAX_HANDLES];
+    // Handles we bound on the remote side, used to match responses
+    Package *tx_handles[PEER_MAX_HANDLES];
+    int tx_count;
+    // What the remote holds, by handle, once it has sent a bitfield.
+    // Written by the reader thread under state_lock.
+    uint8_t *rx_have[PEER_MAX_HANDLES];
+    uint8_t *tx_have[PEER_MAX_HANDLES];
+    pthread_mutex_t state_lock;
+    SubtreeFetch subtrees[PEER_MAX_SUBTREES];
+    int subtree_count;
+    ChunkReceive receives[PEER_MAX_RECEIVES];
+    int receive_count;
+    // Flow control, guarded by state_lock
+    int closing;
+    int send_credit;
+    pthread_cond_t credit_cond;
+    UploadJob *jobs;
+    UploadJob *jobs_tail;
+    // The job upload_worker is serving, guarded by state_lock
+    UploadJob *job_active;
+    pthread_cond_t job_cond;
+    // Frames for the upload thread to send, guarded by state_lock
+    PeerNotice *notices;
+    PeerNotice *notices_tail;
+    int notice_count;
+    // Data frames received since we last granted credit, and when the
+    // download limiters let it go back (monotonic ms, reader only)
+    int recv_unacked;
+    uint64_t credit_due_ms;
+    // Disk queue our received data last filled, -1 if none; credit is
+    // also held back until it drains (reader only)
+    int disk_wait;
+    // Request window and what it is sized from, guarded by state_lock
+    double req_window;
+    double req_latency_ms;
+    double req_min_latency_ms;
+    double rx_rate;
+    uint64_t rate_bytes;
+    uint64_t rate_start_ms;
+    uint64_t last_cut_ms;
+    // Heartbeats: pings sent since the last answer, and the smoothed
+    // round trip and its mean deviation, guarded by state_lock
+    int pings_unanswered;
+    double ping_rtt_ms;
+    double ping_jitter_ms;
+    // Choking, guarded by state_lock: whether we withhold uploads from
+    // the peer and have said so, when it last wanted data from us,
+    // whether it withholds uploads from us, and when we last said we
+    // wanted data from it
+    int am_choking;
+    int choke_sent;
+    uint64_t interested_ms;
+    int remote_choking;
+    uint64_t interest_sent_ms;
+    // Chunk data to and from this peer
+    TokenBucket upload_limit;
+    TokenBucket download_limit;
 } Peer;
 
-extern Peer peers[2048];
+// Peers in the table, read without the lock
 extern int peer_count;
 extern pthread_mutex_t peer_mutex;
 
-void* connect_to_peer(void* arg);
+Peer* create_peer(const char *ip, uint16_t port, int socket);
+int add_peer(Peer *peer);
+void remove_peer(Peer *peer);
+Peer* find_peer(const char *ip, uint16_t port);
+int snapshot_peers(Peer **out, int max);
+int peer_known(const char *ip, uint16_t port);
+void retain_peer(Peer *peer);
+void release_peer(Peer *peer);
+int peer_send(Peer *peer, const struct btide_packet *packet);
+int peer_try_send(Peer *peer, const struct btide_packet *packet);
+int peer_post(Peer *peer, const struct btide_packet *packet);
+uint16_t peer_bind_package(Peer *peer, Package *pkg);
+int peer_track_subtree(Peer *peer, Package *pkg, uint32_t node);
+Package* peer_acquire_package(Peer *peer, uint16_t handle, int ours);
+uint8_t* peer_have_map(Peer *peer, uint16_t handle, int ours);
+int peer_copy_have(Peer *peer, Package *pkg, uint8_t *out);
+int peer_handle_for(Peer *peer, Package *pkg, int *ours);
+int peer_request_window(Peer *peer);
+void peer_request_done(Peer *peer, uint32_t bytes, uint64_t latency_ms, uint64_t now_ms);
+void peer_request_timeout(Peer *peer, uint64_t now_ms);
+int peer_heartbeat_due(Peer *peer);
+void peer_heartbeat_answered(Peer *peer, uint64_t rtt_ms);
+int peer_request_slot(Peer *peer, int slots, uint16_t *notify);
+int peer_is_interested(Peer *peer, uint64_t now);
+int peer_set_choking(Peer *peer, int choke, uint16_t *notify);
+int peer_is_choking_us(Peer *peer);
+void peer_set_choking_us(Peer *peer, int choking);
+int peer_interest_due(Peer *peer, uint64_t now);
+void peer_drop_uploads(Peer *peer);
+int peer_take_credit(Peer *peer);
+void peer_grant_credit(Peer *peer, int credit);
+int peer_queue_upload(Peer *peer, const UploadJob *job);
+UploadJob* peer_next_upload(Peer *peer);
+void peer_finish_upload(Peer *peer, UploadJob *job);
+int peer_upload_cancelled(Peer *peer);
+void peer_cancel_upload(Peer *peer, Package *pkg, uint32_t index);
+void peer_forget_package(Package *pkg);
+void peer_close(Peer *peer);
+int peer_receive_data(Peer *peer, Package *pkg, uint32_t chunk_index, uint32_t offset,
+    const char *data, uint32_t len, uint8_t digest[DIGEST_LEN]);
+int peer_subtree_progress(Peer *peer, Package *pkg, uint32_t chunk_index, uint32_t *node);
+
 void connect_peer(const char *ip, uint16_t port);
 void disconnect_peer(const char *ip, uint16_t port);
 void list_peers();
 
 #endif // PEER_H
-
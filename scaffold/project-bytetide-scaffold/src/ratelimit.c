@@ -0,0 +1,86 @@
+// src/ratelimit.c
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include "config.h"
+#include "ratelimit.h"
+
+TokenBucket upload_limit;
+TokenBucket download_limit;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Rates and bursts are in KB. Without an explicit burst a bucket holds
+// one second's worth.
+void bucket_init(TokenBucket *bucket, int rate_kb, int burst_kb) {
+    bucket->rate = (int64_t)rate_kb * 1024;
+    bucket->burst = burst_kb > 0 ? (int64_t)burst_kb * 1024 : bucket->rate;
+    bucket->tokens = bucket->burst;
+    bucket->last_ns = monotonic_ns();
+}
+
+// Credits the time since the last refill. Whoever wins the race to move
+// last_ns forward adds the tokens; it only moves by the time whole
+// tokens account for, so frequent callers never round the rate away.
+static void bucket_refill(TokenBucket *bucket) {
+    uint64_t now = monotonic_ns();
+    uint64_t last = __atomic_load_n(&bucket->last_ns, __ATOMIC_ACQUIRE);
+    if (now <= last) {
+        return;
+    }
+    int64_t add = (int64_t)((double)(now - last) * (double)bucket->rate / 1e9);
+    if (add <= 0) {
+        return;
+    }
+    // After a long idle spell only the burst matters
+    uint64_t next = add > bucket->burst ? now : last + (uint64_t)((double)add * 1e9 / (double)bucket->rate);
+    if (!__atomic_compare_exchange_n(&bucket->last_ns, &last, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    int64_t tokens = __atomic_load_n(&bucket->tokens, __ATOMIC_ACQUIRE);
+    int64_t filled;
+    do {
+        filled = tokens + add;
+        if (filled > bucket->burst) {
+            filled = bucket->burst;
+        }
+    } while (!__atomic_compare_exchange_n(&bucket->tokens, &tokens, filled, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+// Takes bytes without waiting. Returns how many ns until the refill
+// covers the debt that leaves, 0 if there is none.
+uint64_t bucket_charge(TokenBucket *bucket, uint32_t bytes) {
+    if (bucket->rate <= 0) {
+        return 0;
+    }
+    bucket_refill(bucket);
+    int64_t left = __atomic_sub_fetch(&bucket->tokens, (int64_t)bytes, __ATOMIC_ACQ_REL);
+    if (left >= 0) {
+        return 0;
+    }
+    // Everyone queued before us is part of the debt, so waiting it off
+    // serves callers in the order they arrived
+    return (uint64_t)((double)-left * 1e9 / (double)bucket->rate);
+}
+
+void bucket_consume(TokenBucket *bucket, uint32_t bytes) {
+    uint64_t wait_ns = bucket_charge(bucket, bytes);
+    if (wait_ns == 0) {
+        return;
+    }
+    struct timespec ts = { (time_t)(wait_ns / 1000000000), (long)(wait_ns % 1000000000) };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+    bucket_refill(bucket);
+}
+
+void init_rate_limits(void) {
+    bucket_init(&upload_limit, config.upload_rate, config.rate_burst);
+    bucket_init(&download_limit, config.download_rate, config.rate_burst);
+}
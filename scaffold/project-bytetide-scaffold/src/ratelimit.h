@@ -0,0 +1,28 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+// A token bucket shared by any number of threads without a lock.
+// Callers take what they send up front and, if that leaves the bucket
+// in debt, sleep until the refill would have covered it, or hold back
+// whatever lets the other side send more until then.
+typedef struct {
+    // Bytes per second, 0 for no limit
+    int64_t rate;
+    // Most bytes that may go out back to back after an idle spell
+    int64_t burst;
+    int64_t tokens;
+    uint64_t last_ns;
+} TokenBucket;
+
+// Whole-node limits, set from the configuration at startup
+extern TokenBucket upload_limit;
+extern TokenBucket download_limit;
+
+void bucket_init(TokenBucket *bucket, int rate_kb, int burst_kb);
+uint64_t bucket_charge(TokenBucket *bucket, uint32_t bytes);
+void bucket_consume(TokenBucket *bucket, uint32_t bytes);
+void init_rate_limits(void);
+
+#endif // RATELIMIT_H
@@ -0,0 +1,308 @@
+// src/superseed.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "network.h"
+#include "superseed.h"
+
+// Super-seeding: while it runs we advertise an empty bitfield and offer
+// each interested peer a single chunk with HAV, never one already
+// offered to someone else. A peer gets its next chunk once another peer
+// is seen holding the last one, i.e. once it has passed it on. It ends
+// when the swarm holds every chunk, at which point we advertise in full.
+static SuperSeed *superseeds = NULL;
+static pthread_mutex_t superseeds_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int test_bit(const uint8_t *map, uint32_t index) {
+    return (map[index / 8] >> (index % 8)) & 1;
+}
+
+static void set_bit(uint8_t *map, uint32_t index, int on) {
+    if (on) {
+        map[index / 8] |= (uint8_t)(1 << (index % 8));
+    } else {
+        map[index / 8] &= (uint8_t)~(1 << (index % 8));
+    }
+}
+
+static SeedOffer* offer_of(SuperSeed *s, Peer *peer) {
+    for (int i = 0; i < s->noffers; i++) {
+        if (s->offers[i]->peer == peer) {
+            return s->offers[i];
+        }
+    }
+    return NULL;
+}
+
+static void drop_offer(SuperSeed *s, int slot) {
+    SeedOffer *o = s->offers[slot];
+    if (o->chunk >= 0) {
+        set_bit(s->offered, (uint32_t)o->chunk, 0);
+    }
+    s->offers[slot] = s->offers[--s->noffers];
+    release_peer(o->peer);
+    free(o->have);
+    free(o);
+}
+
+static int peer_is_closing(Peer *peer) {
+    pthread_mutex_lock(&peer->state_lock);
+    int closing = peer->closing;
+    pthread_mutex_unlock(&peer->state_lock);
+    return closing;
+}
+
+// Tracks every connected peer that has the package bound on its
+// connection, and drops the ones that went away. A newcomer is sent an
+// empty bitfield in case it bound the package before we started.
+static void sync_offers(SuperSeed *s) {
+    Peer *snapshot[SUPERSEED_MAX_PEERS];
+    int count = snapshot_peers(snapshot, SUPERSEED_MAX_PEERS);
+
+    for (int i = 0; i < count; i++) {
+        Peer *peer = snapshot[i];
+        int ours;
+        int handle = peer_handle_for(peer, s->pkg, &ours);
+        SeedOffer *o = NULL;
+        if (handle >= 0 && !offer_of(s, peer) && !peer_is_closing(peer) && s->noffers < SUPERSEED_MAX_PEERS) {
+            o = calloc(1, sizeof(SeedOffer));
+            if (o) {
+                o->have = calloc((s->pkg->nchunks + 7) / 8 + 1, 1);
+            }
+        }
+        if (!o || !o->have) {
+            if (o) {
+                free(o);
+            }
+            release_peer(peer);
+            continue;
+        }
+        o->peer = peer;
+        o->chunk = -1;
+        s->offers[s->noffers++] = o;
+        send_bitfield(peer, (uint16_t)handle, ours ? HANDLE_SENDER : HANDLE_RECEIVER, s->pkg);
+    }
+
+    for (int i = s->noffers - 1; i >= 0; i--) {
+        if (peer_is_closing(s->offers[i]->peer)) {
+            drop_offer(s, i);
+        }
+    }
+}
+
+// Reloads what each peer advertised. Returns the number of chunks no
+// peer holds yet.
+static uint32_t refresh_seen(SuperSeed *s) {
+    memset(s->seen, 0, s->pkg->nchunks * sizeof(uint16_t));
+    for (int i = 0; i < s->noffers; i++) {
+        SeedOffer *o = s->offers[i];
+        peer_copy_have(o->peer, s->pkg, o->have);
+        for (uint32_t c = 0; c < s->pkg->nchunks; c++) {
+            s->seen[c] += (uint16_t)test_bit(o->have, c);
+        }
+    }
+    uint32_t unseen = 0;
+    for (uint32_t c = 0; c < s->pkg->nchunks; c++) {
+        unseen += s->seen[c] == 0;
+    }
+    return unseen;
+}
+
+// Whether a peer other than the one it was offered to holds the chunk
+static int passed_on(SuperSeed *s, SeedOffer *o, uint32_t index) {
+    for (int i = 0; i < s->noffers; i++) {
+        if (s->offers[i] != o && test_bit(s->offers[i]->have, index)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The rarest chunk the peer lacks that nobody else is being offered,
+// least offered so far first. Starts at a random chunk so ties spread.
+static int pick_offer(SuperSeed *s, SeedOffer *o) {
+    uint32_t n = s->pkg->nchunks;
+    uint32_t start = (uint32_t)rand() % n;
+    int best = -1;
+    for (uint32_t k = 0; k < n; k++) {
+        uint32_t i = (start + k) % n;
+        if (test_bit(o->have, i) || test_bit(s->offered, i)) {
+            continue;
+        }
+        if (best < 0 || s->seen[i] < s->seen[best]
+            || (s->seen[i] == s->seen[best] && s->offered_count[i] < s->offered_count[best])) {
+            best = (int)i;
+        }
+    }
+    return best;
+}
+
+static void free_superseed(SuperSeed *s) {
+    while (s->noffers > 0) {
+        drop_offer(s, s->noffers - 1);
+    }
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s->seen);
+    free(s->offered_count);
+    free(s->offered);
+    free(s);
+}
+
+static void* superseed_worker(void* arg) {
+    SuperSeed *s = (SuperSeed*)arg;
+    int done = 0;
+
+    while (!s->stopped && !done) {
+        sync_offers(s);
+        done = s->noffers > 0 && refresh_seen(s) == 0;
+
+        uint64_t now = monotonic_ms();
+        for (int i = 0; i < s->noffers && !done; i++) {
+            SeedOffer *o = s->offers[i];
+            if (o->chunk >= 0) {
+                uint32_t c = (uint32_t)o->chunk;
+                // Whether or not the peer took it, an old offer is freed
+                // so a peer that never fetches cannot hold a chunk back
+                int stale = now - o->offered_ms > SUPERSEED_OFFER_TIMEOUT * 1000;
+                if (!passed_on(s, o, c) && !stale) {
+                    continue;
+                }
+                set_bit(s->offered, c, 0);
+                o->chunk = -1;
+            }
+            int index = pick_offer(s, o);
+            if (index < 0) {
+                continue;
+            }
+            o->chunk = index;
+            o->offered_ms = now;
+            s->offered_count[index]++;
+            set_bit(s->offered, (uint32_t)index, 1);
+            send_have(o->peer, s->pkg, (uint32_t)index);
+        }
+
+        pthread_mutex_lock(&s->lock);
+        if (!done && !s->changed && !s->stopped) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&s->cond, &s->lock, &deadline);
+        }
+        s->changed = 0;
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    // Everyone gets the real bitfield now the swarm can serve itself
+    __atomic_store_n(&s->pkg->superseeding, 0, __ATOMIC_RELEASE);
+    for (int i = 0; i < s->noffers; i++) {
+        int ours;
+        int handle = peer_handle_for(s->offers[i]->peer, s->pkg, &ours);
+        if (handle >= 0) {
+            send_bitfield(s->offers[i]->peer, (uint16_t)handle, ours ? HANDLE_SENDER : HANDLE_RECEIVER, s->pkg);
+        }
+    }
+    if (done) {
+        printf("Super-seeding of %s finished, the swarm holds every chunk\n", s->pkg->ident);
+    }
+
+    pthread_mutex_lock(&superseeds_mutex);
+    SuperSeed **link = &superseeds;
+    while (*link && *link != s) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = s->next;
+    }
+    pthread_mutex_unlock(&superseeds_mutex);
+    // Wait out any event handler that found s before it was unlinked
+    pthread_mutex_lock(&s->lock);
+    pthread_mutex_unlock(&s->lock);
+
+    Package *pkg = s->pkg;
+    free_superseed(s);
+    release_package(pkg);
+    return NULL;
+}
+
+int start_superseed(Package *pkg) {
+    if (!package_is_complete(pkg)) {
+        printf("Only a complete package can be super-seeded.\n");
+        return -1;
+    }
+
+    SuperSeed *s = calloc(1, sizeof(SuperSeed));
+    if (!s) {
+        fprintf(stderr, "Failed to allocate super-seed\n");
+        return -1;
+    }
+    s->pkg = pkg;
+    s->seen = calloc(pkg->nchunks, sizeof(uint16_t));
+    s->offered_count = calloc(pkg->nchunks, sizeof(uint32_t));
+    s->offered = calloc((pkg->nchunks + 7) / 8 + 1, 1);
+    if (!s->seen || !s->offered_count || !s->offered) {
+        fprintf(stderr, "Failed to allocate super-seed\n");
+        free(s->seen);
+        free(s->offered_count);
+        free(s->offered);
+        free(s);
+        return -1;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    pthread_mutex_lock(&superseeds_mutex);
+    for (SuperSeed *it = superseeds; it; it = it->next) {
+        if (it->pkg == pkg) {
+            pthread_mutex_unlock(&superseeds_mutex);
+            printf("Package is already super-seeding.\n");
+            free_superseed(s);
+            return -1;
+        }
+    }
+    s->next = superseeds;
+    superseeds = s;
+    // Set before the worker runs so no bind in between sees our bitfield
+    __atomic_store_n(&pkg->superseeding, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&superseeds_mutex);
+
+    // Held by the worker, as for downloads
+    retain_package(pkg);
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, superseed_worker, s);
+    pthread_detach(thread_id);
+    return 0;
+}
+
+// A peer bound the package or advertised more of it
+void superseed_peer_changed(Package *pkg) {
+    pthread_mutex_lock(&superseeds_mutex);
+    for (SuperSeed *s = superseeds; s; s = s->next) {
+        if (s->pkg == pkg) {
+            pthread_mutex_lock(&s->lock);
+            s->changed = 1;
+            pthread_cond_signal(&s->cond);
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&superseeds_mutex);
+}
+
+void superseed_package_removed(Package *pkg) {
+    pthread_mutex_lock(&superseeds_mutex);
+    for (SuperSeed *s = superseeds; s; s = s->next) {
+        if (s->pkg == pkg) {
+            pthread_mutex_lock(&s->lock);
+            s->stopped = 1;
+            pthread_cond_signal(&s->cond);
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&superseeds_mutex);
+}
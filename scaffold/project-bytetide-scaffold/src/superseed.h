@@ -0,0 +1,48 @@
+#ifndef SUPERSEED_H
+#define SUPERSEED_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "package.h"
+#include "peer.h"
+
+#define SUPERSEED_MAX_PEERS 2048
+// Seconds an offer stands before the chunk is freed for others and the
+// peer offered another, so peers that cannot reach each other, or that
+// never fetch what they are offered, do not stall the seed
+#define SUPERSEED_OFFER_TIMEOUT 30
+
+// One peer interested in a super-seeded package and the single chunk
+// currently offered to it
+typedef struct {
+    Peer *peer;
+    // Chunks the peer has advertised
+    uint8_t *have;
+    // Offered chunk, or -1 before the first offer
+    int64_t chunk;
+    uint64_t offered_ms;
+} SeedOffer;
+
+typedef struct SuperSeed {
+    Package *pkg;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // Only the worker touches the offers and counts
+    SeedOffer *offers[SUPERSEED_MAX_PEERS];
+    int noffers;
+    // Per chunk: peers known to hold it, times it has been offered, and
+    // whether it is on offer right now
+    uint16_t *seen;
+    uint32_t *offered_count;
+    uint8_t *offered;
+    // A peer advertised something since the worker last looked
+    int changed;
+    int stopped;
+    struct SuperSeed *next;
+} SuperSeed;
+
+int start_superseed(Package *pkg);
+void superseed_peer_changed(Package *pkg);
+void superseed_package_removed(Package *pkg);
+
+#endif // SUPERSEED_H